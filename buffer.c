@@ -1,73 +1,233 @@
 #include "buffer.h"
 
+#include <errno.h>
+#include <pthread.h>
+
+#define BUFFER_POOLBYTES (4 * 1024 * 1024)  /* max bytes cached by class */
+
+/* Free storage, linked through its first bytes */
+struct block {
+    struct block *next;
+};
+
+static struct {
+    struct block *free;
+    size_t nfree;
+    size_t nused;
+} pool[BUFFER_NCLASSES];
+
+static size_t nlarge;   /* storages too large for the pool */
+
+/* The pool is shared by Lua states that may run on different threads. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * Create a buffer of given size.
+ * Get the pool class of storage size, or -1 if it is too large.
  */
-struct buffer *
-buffer_create(size_t size)
+static int
+__buffer_class(size_t size)
 {
-    struct buffer *buf = malloc(sizeof(*buf));
-    if (!buf)
-        return NULL;
-
-    buf->start = malloc(size);
-    if (!buf->start) {
-        free(buf);
-        return NULL;
+    int c = 0;
+    while (((size_t)1 << (BUFFER_MINCLASS + c)) < size) {
+        if (++c == BUFFER_NCLASSES)
+            return -1;
     }
+    return c;
+}
 
-    buf->pos = buf->start;
-    buf->last = buf->start;
-    buf->end = buf->start + size;
+/**
+ * Borrow storage of at least *size bytes, *size is set to its actual size.
+ */
+static char *
+__buffer_alloc(size_t *size)
+{
+    int c = __buffer_class(*size);
+    if (c == -1) {
+        char *p = malloc(*size);
+        if (p) {
+            pthread_mutex_lock(&lock);
+            nlarge++;
+            pthread_mutex_unlock(&lock);
+        }
+        return p;
+    }
 
-    return buf;
+    *size = (size_t)1 << (BUFFER_MINCLASS + c);
+    pthread_mutex_lock(&lock);
+    struct block *b = pool[c].free;
+    if (b) {
+        pool[c].free = b->next;
+        pool[c].nfree--;
+    }
+    pool[c].nused++;
+    pthread_mutex_unlock(&lock);
+    if (!b) {
+        // allocate out of the lock
+        b = malloc(*size);
+        if (!b) {
+            pthread_mutex_lock(&lock);
+            pool[c].nused--;
+            pthread_mutex_unlock(&lock);
+        }
+    }
+    return (char *)b;
 }
 
 /**
- * Shrink the buffer.
- *
- * Move string to starting point of buffer.
+ * Give back storage of given size to the pool.
+ */
+static void
+__buffer_dealloc(char *p, size_t size)
+{
+    int c = __buffer_class(size);
+    if (c == -1) {
+        pthread_mutex_lock(&lock);
+        nlarge--;
+        pthread_mutex_unlock(&lock);
+        free(p);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    pool[c].nused--;
+    if ((pool[c].nfree + 1) * size > BUFFER_POOLBYTES) {
+        pthread_mutex_unlock(&lock);
+        free(p);
+        return;
+    }
+    struct block *b = (struct block *)p;
+    b->next = pool[c].free;
+    pool[c].free = b;
+    pool[c].nfree++;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Init an empty buffer, without storage.
  */
 void
-buffer_shrink(struct buffer *buf)
+buffer_init(struct buffer *buf)
 {
-    memmove(buf->start, buf->pos, buf->last - buf->pos);
-    buf->last = buf->start + (buf->last - buf->pos);
-    buf->pos = buf->start;
+    buf->pos = NULL;
+    buf->last = NULL;
+    buf->start = NULL;
+    buf->end = NULL;
+    buf->max = BUFFER_MAXSIZE;
 }
 
 /**
- * Grow buffer extra size.
+ * Make room for at least size bytes after the string.
+ *
+ * Consumed space is reused when the string is at most half of the buffer, so
+ * the bytes moved are paid for by the bytes consumed before; otherwise the
+ * buffer is doubled, up to its maximum size.
+ *
+ * Returns 0 on success, -1 with errno set to ENOBUFS if the buffer would
+ * exceed its maximum size, or ENOMEM.
  */
 int
-buffer_grow(struct buffer *buf, size_t extra)
+buffer_reserve(struct buffer *buf, size_t size)
 {
-    if (extra <= 0)
+    size_t len = buffer_size(buf);
+    size_t capacity = buffer_capacity(buf);
+
+    if (buf->start && buffer_available(buf) >= size)
         return 0;
 
-    size_t size = buffer_capacity(buf) + extra;
+    if (buf->start && len + size <= capacity && len <= capacity / 2) {
+        memmove(buf->start, buf->pos, len);
+        buf->pos = buf->start;
+        buf->last = buf->start + len;
+        return 0;
+    }
 
-    size_t pos_off = buf->pos - buf->start;
-    size_t last_off = buf->last - buf->start;
-        
-    buf->start = realloc(buf->start, size);
-    if (buf->start == NULL)
+    if (len + size > buf->max) {
+        errno = ENOBUFS;
         return -1;
+    }
+    capacity *= 2;
+    if (capacity < len + size)
+        capacity = len + size;
+    if (capacity > buf->max)
+        capacity = buf->max;
 
-    buf->pos = buf->start + pos_off;
-    buf->last = buf->start + last_off;
-    buf->end = buf->start + size;
+    char *start = __buffer_alloc(&capacity);
+    if (start == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (buf->start) {
+        memcpy(start, buf->pos, len);
+        __buffer_dealloc(buf->start, buffer_capacity(buf));
+    }
+    buf->start = start;
+    buf->pos = start;
+    buf->last = start + len;
+    buf->end = start + capacity;
+    return 0;
+}
 
+/**
+ * Append data at the end of string, growing the buffer if needed.
+ */
+int
+buffer_append(struct buffer *buf, const char *data, size_t len)
+{
+    if (buffer_reserve(buf, len) == -1)
+        return -1;
+    memcpy(buf->last, data, len);
+    buf->last += len;
     return 0;
 }
 
 /**
- * Delete the buffer.
+ * Consume len bytes at the start of string. The storage is given back to the
+ * pool once the buffer is empty.
  */
 void
-buffer_delete(struct buffer *buf)
+buffer_consume(struct buffer *buf, size_t len)
 {
-    if (buf->start) free(buf->start);
+    buf->pos += len;
+    if (buf->pos >= buf->last)
+        buffer_free(buf);
+}
+
+/**
+ * Give back the storage of buffer to the pool, discarding its data.
+ */
+void
+buffer_free(struct buffer *buf)
+{
+    if (buf->start)
+        __buffer_dealloc(buf->start, buffer_capacity(buf));
+    buf->pos = NULL;
+    buf->last = NULL;
     buf->start = NULL;
-    free(buf);
+    buf->end = NULL;
+}
+
+/**
+ * Get statistics of pool classes, followed by storages too large for the
+ * pool. At most n entries are stored.
+ *
+ * Returns the number of entries stored.
+ */
+int
+buffer_poolstats(struct buffer_poolstat *stats, int n)
+{
+    int c;
+    pthread_mutex_lock(&lock);
+    for (c = 0; c < BUFFER_NCLASSES && c < n; c++) {
+        stats[c].size = (size_t)1 << (BUFFER_MINCLASS + c);
+        stats[c].used = pool[c].nused;
+        stats[c].cached = pool[c].nfree;
+    }
+    if (c < n) {
+        stats[c].size = 0;
+        stats[c].used = nlarge;
+        stats[c].cached = 0;
+        c++;
+    }
+    pthread_mutex_unlock(&lock);
+    return c;
 }
@@ -2,25 +2,50 @@
 #define BUFFER_H
 /**
  * String Buffer.
+ *
+ * Data is kept contiguous between pos and last, so it can be parsed in place.
+ * Consuming data only moves pos; the space before it is reclaimed lazily when
+ * more room is needed, and the buffer grows geometrically up to its maximum
+ * size. Appending and consuming n bytes costs amortized O(n).
+ *
+ * Buffer storage is borrowed from a pool of power of two size classes when
+ * data is added, and given back as soon as all of it is consumed, so idle
+ * buffers hold no memory. The pool is shared by the whole process, and
+ * guarded by a mutex.
  */
 
 #include <stdlib.h>
 #include <string.h>
 
+#define BUFFER_MAXSIZE  (64 * 1024 * 1024)  /* default capacity cap */
+
+#define BUFFER_MINCLASS 12  /* smallest pooled storage, 4KB */
+#define BUFFER_MAXCLASS 20  /* largest pooled storage, 1MB */
+#define BUFFER_NCLASSES (BUFFER_MAXCLASS - BUFFER_MINCLASS + 1)
+
 struct buffer {
     char *pos;      /* start position of string */
     char *last;     /* end position of string */
-    char *start;    /* start of buffer */
+    char *start;    /* start of buffer, NULL if no storage */
     char *end;      /* end of buffer */
+    size_t max;     /* maximum capacity */
+};
+
+struct buffer_poolstat {
+    size_t size;    /* storage size, 0 for storage larger than pooled ones */
+    size_t used;    /* number of storages used by buffers */
+    size_t cached;  /* number of free storages kept by pool */
 };
 
-#define buffer_size(buf)      (buf->last - buf->pos)
-#define buffer_available(buf) (buf->end - buf->last)
-#define buffer_capacity(buf)  (buf->end - buf->start)
+#define buffer_size(buf)      ((size_t)((buf)->last - (buf)->pos))
+#define buffer_available(buf) ((size_t)((buf)->end - (buf)->last))
+#define buffer_capacity(buf)  ((size_t)((buf)->end - (buf)->start))
 
-struct buffer *buffer_create(size_t size);
-void buffer_shrink(struct buffer *buf);
-int buffer_grow(struct buffer *buf, size_t extra);
-void buffer_delete(struct buffer *buf);
+void buffer_init(struct buffer *buf);
+int buffer_reserve(struct buffer *buf, size_t size);
+int buffer_append(struct buffer *buf, const char *data, size_t len);
+void buffer_consume(struct buffer *buf, size_t len);
+void buffer_free(struct buffer *buf);
+int buffer_poolstats(struct buffer_poolstat *stats, int n);
 
 #endif
@@ -9,17 +9,19 @@ for i = 1, 20 do
   table.insert(paths, path)
 end
 
-function worker(sock, path)
-  local ok, err = sock:connect('www.verycd.com', 80)
-  if err then
-    print(path .. " failed")
-    return
+function fetch(sock, path, connected)
+  if not connected then
+    local ok, err = sock:connect('www.verycd.com', 80)
+    if err then
+      print(path .. " failed")
+      return
+    end
   end
 
   sock:write("GET " .. path .. " HTTP/1.1\r\n")
   sock:write("Host: www.verycd.com\r\n")
   sock:write("\r\n")
-  coroutine.yield(true)
+
   while true do
     local data, err, partial = sock:read(8192)
     if err then
@@ -35,80 +37,48 @@ function worker(sock, path)
     if err then
       break
     end
-    coroutine.yield(true)
   end
-  coroutine.yield(nil)
+  sock:close()
 end
 
 if arg[1] == "sequence" then
   print("sequence...")
   for i, path in ipairs(paths) do
-    local sock = socket.tcp()
-    local ok, err = sock:connect('www.verycd.com', 80)
-    if err then
-      print(path .. " failed")
-      return
-    end
-
-    sock:write("GET " .. path .. " HTTP/1.1\r\n")
-    sock:write("Host: www.verycd.com\r\n")
-    sock:write("\r\n")
-
-    while true do
-      local data, err, partial = sock:read(8192)
-      if err then
-        if err == socket.ERROR_CLOSED then
-          data = partial
-        end
-      end
-      if contents[path] == nil then
-        contents[path] = data
-      else
-        contents[path] = contents[path] .. data
-      end
-      if err then
-        break
-      end
+    fetch(socket.tcp(), path)
+  end
+elseif arg[1] == "fanout" then
+  -- Connect to all in parallel first, then send requests over the
+  -- connections which succeeded.
+  print("fanout...")
+  local socks = {}
+  for i, path in ipairs(paths) do
+    socks[i] = socket.tcp()
+    socks[i]:connect_start('www.verycd.com', 80)
+  end
+  local results = socket.connect_all(socks, 5)
+  for i, path in ipairs(paths) do
+    if results[i] == true then
+      socket.spawn(fetch, socks[i], path, true)
+    else
+      print(path .. " failed: " .. results[i])
     end
   end
+  socket.run()
 else
-  print("selecting...")
-  local threads = {}
-
+  -- Each fetch runs in a coroutine managed by the scheduler, socket methods
+  -- yield to it instead of blocking.
+  print("spawning...")
   for i, path in ipairs(paths) do
-    local sock = socket.tcp()
-    local thread = coroutine.create(function () worker(sock, path) end)
-    coroutine.resume(thread) -- initialize
-    threads[sock:fileno()] = thread
+    socket.spawn(fetch, socket.tcp(), path)
   end
 
-  while true do
-    local fds = {}
-    for fd, _ in pairs(threads) do
-      table.insert(fds, fd)
-    end
-
-    if 0 == #fds then
-      -- no more to do
-      break
-    end
-
-    local readfds, writefds, err = socket.select(fds, fds)
-
-    if err then
-      print(err)
-      os.exit()
-    elseif readfds then
-      for _, fd in ipairs(readfds) do
-        local status, result = coroutine.resume(threads[fd])
-        if result == nil then
-          threads[fd] = nil
-        end
-      end
-    end
+  local ok, err = socket.run()
+  if err then
+    print(err)
+    os.exit()
   end
 end
 
 for _, path in ipairs(paths) do
-  print(path, #contents[path])
+  print(path, contents[path] and #contents[path])
 end
@@ -0,0 +1,68 @@
+#!/usr/bin/env lua
+-- Loopback accept benchmark: server workers with their own SO_REUSEPORT
+-- listener, against as many client workers, for a few seconds.
+--
+--   lua examples/reuseport-bench.lua [max_workers=4] [seconds=3]
+local socket = require "ssocket"
+
+local port = 17800
+local max = tonumber(arg[1]) or 4
+local duration = tonumber(arg[2]) or 3
+
+local function server(path, deadline, cpu)
+  local listener = socket.tcp()
+  assert(listener:bind("127.0.0.1", port, {reuseport = true, incoming_cpu = cpu}))
+  assert(listener:listen(1024))
+  listener:settimeout(0.1)
+  local accepts = 0
+  while os.time() < deadline do
+    local conns = listener:acceptmany()
+    if conns then
+      for _, conn in ipairs(conns) do
+        conn:close()
+      end
+      accepts = accepts + #conns
+    end
+  end
+  listener:close()
+  local f = io.open(path, "w")
+  f:write(accepts)
+  f:close()
+end
+
+local function client(start, deadline)
+  while os.time() < start do end
+  while os.time() < deadline do
+    local sock = socket.tcp()
+    sock:connect("127.0.0.1", port)
+    sock:close()
+  end
+end
+
+local n = 1
+while n <= max do
+  local paths = {}
+  for i = 1, n do
+    paths[i] = os.tmpname()
+  end
+  -- clients start one second late, once listeners are bound
+  local start = os.time() + 1
+  local deadline = start + duration
+  assert(socket.fork_workers(2 * n, function (i, cpu)
+    if i <= n then
+      server(paths[i], deadline, cpu)
+    else
+      client(start, deadline)
+    end
+  end, {pin = true}))
+
+  local total = 0
+  for i = 1, n do
+    local f = io.open(paths[i])
+    total = total + (tonumber(f:read("*a")) or 0)
+    f:close()
+    os.remove(paths[i])
+  end
+  print(string.format("%d workers: %d accepts/sec", n, total / duration))
+  n = n * 2
+end
@@ -0,0 +1,677 @@
+#include "compat.h"
+#include "poller.h"
+#include "timeout.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+/**
+ * Time left before deadline (in seconds).
+ *
+ * A negative timeout means waiting forever, 0 means not waiting at all.
+ */
+static double
+__poller_left(double timeout, double deadline)
+{
+    if (timeout <= 0)
+        return timeout;
+    double left = deadline - timeout_gettime();
+    return left > 0.0 ? left : 0.0;
+}
+
+/**
+ * Convert the time left before deadline into poll timeout (in ms), rounded
+ * up.
+ */
+static int
+__poller_timeout(double timeout, double deadline)
+{
+    return timeout_ms(__poller_left(timeout, deadline));
+}
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#if defined(POLLER_IO_URING)
+#include "uring.h"
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+
+struct upoll {
+    void *ud;
+    int events;         /* registered events, 0 if not registered */
+    unsigned gen;       /* bumped whenever the armed poll goes stale */
+    char armed;         /* a poll request is in flight */
+    char queued;        /* in the queue of polls to arm */
+};
+#endif
+
+struct poller {
+    int epfd;
+    struct epoll_event *events;
+    int nevents;
+#if defined(POLLER_IO_URING)
+    struct uring *ring;     /* NULL when backed by epoll */
+    struct upoll *fds;
+    int nfds;
+    int *queue;
+    int nqueue;
+    int queuesize;
+#endif
+};
+
+/**
+ * Create a poller.
+ */
+struct poller *
+poller_create(void)
+{
+    struct poller *p = malloc(sizeof(*p));
+    if (!p)
+        return NULL;
+
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (p->epfd == -1) {
+        free(p);
+        return NULL;
+    }
+    p->events = NULL;
+    p->nevents = 0;
+#if defined(POLLER_IO_URING)
+    p->ring = NULL;
+#endif
+    return p;
+}
+
+#if defined(POLLER_IO_URING)
+/*
+ * io_uring backend: readiness is requested by one-shot IORING_OP_POLL_ADD
+ * requests, which are queued and submitted together with the wait, so each
+ * scheduler iteration costs a single io_uring_enter(2). Polls are re-armed
+ * after completion, which keeps level-triggered semantics.
+ */
+
+#define URING_ENTRIES   256
+#define URING_IGNORE    ((uint64_t)-1)  /* user_data of removals and timeouts */
+
+static uint64_t
+__uring_key(struct poller *p, int fd)
+{
+    return ((uint64_t)p->fds[fd].gen << 32) | (uint32_t)fd;
+}
+
+static int
+__uring_grow(struct poller *p, int fd)
+{
+    if (fd < p->nfds)
+        return 0;
+    int nfds = p->nfds ? p->nfds : 64;
+    while (nfds <= fd)
+        nfds *= 2;
+    struct upoll *fds = realloc(p->fds, nfds * sizeof(*fds));
+    if (!fds)
+        return -1;
+    memset(fds + p->nfds, 0, (nfds - p->nfds) * sizeof(*fds));
+    p->fds = fds;
+    p->nfds = nfds;
+    return 0;
+}
+
+/**
+ * Queue fd to have its poll armed by next poller_wait().
+ */
+static int
+__uring_queue(struct poller *p, int fd)
+{
+    if (p->fds[fd].queued)
+        return 0;
+    if (p->nqueue == p->queuesize) {
+        int size = p->queuesize ? p->queuesize * 2 : 64;
+        int *queue = realloc(p->queue, size * sizeof(*queue));
+        if (!queue)
+            return -1;
+        p->queue = queue;
+        p->queuesize = size;
+    }
+    p->queue[p->nqueue++] = fd;
+    p->fds[fd].queued = 1;
+    return 0;
+}
+
+/**
+ * Cancel the poll in flight for fd, if any.
+ */
+static int
+__uring_disarm(struct poller *p, int fd)
+{
+    struct upoll *u = &p->fds[fd];
+    if (!u->armed)
+        return 0;
+    struct io_uring_sqe *sqe = uring_sqe(p->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = __uring_key(p, fd);
+    sqe->user_data = URING_IGNORE;
+    u->armed = 0;
+    u->gen++;
+    return 0;
+}
+
+static int
+__uring_arm(struct poller *p, int fd)
+{
+    struct upoll *u = &p->fds[fd];
+    struct io_uring_sqe *sqe = uring_sqe(p->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = 0;
+    if (u->events & POLLER_READ)
+        sqe->poll_events |= POLLIN;
+    if (u->events & POLLER_WRITE)
+        sqe->poll_events |= POLLOUT;
+    sqe->user_data = __uring_key(p, fd);
+    u->armed = 1;
+    return 0;
+}
+
+static int
+__uring_add(struct poller *p, int fd, int events, void *ud)
+{
+    if (__uring_grow(p, fd) == -1)
+        return -1;
+    if (p->fds[fd].events) {
+        errno = EEXIST;
+        return -1;
+    }
+    p->fds[fd].ud = ud;
+    p->fds[fd].events = events & (POLLER_READ | POLLER_WRITE);
+    return __uring_queue(p, fd);
+}
+
+static int
+__uring_mod(struct poller *p, int fd, int events, void *ud)
+{
+    if (fd >= p->nfds || !p->fds[fd].events) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (__uring_disarm(p, fd) == -1)
+        return -1;
+    p->fds[fd].ud = ud;
+    p->fds[fd].events = events & (POLLER_READ | POLLER_WRITE);
+    return __uring_queue(p, fd);
+}
+
+static int
+__uring_del(struct poller *p, int fd)
+{
+    if (fd >= p->nfds || !p->fds[fd].events) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (__uring_disarm(p, fd) == -1)
+        return -1;
+    p->fds[fd].events = 0;
+    return 0;
+}
+
+static int
+__uring_wait(struct poller *p, struct poller_event *evs, int nevs,
+             double timeout)
+{
+    double deadline = timeout_gettime() + timeout;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    int i, n = 0;
+
+    do {
+        // arm polls queued since last wait, submitted by the wait below
+        for (i = 0; i < p->nqueue; i++) {
+            int fd = p->queue[i];
+            p->fds[fd].queued = 0;
+            if (p->fds[fd].events && !p->fds[fd].armed && __uring_arm(p, fd) == -1) {
+                memmove(p->queue, p->queue + i, (p->nqueue - i) * sizeof(int));
+                p->nqueue -= i;
+                p->fds[fd].queued = 1;
+                return -1;
+            }
+        }
+        p->nqueue = 0;
+
+        unsigned wait_nr = 0;
+        if (timeout != 0 && !uring_peek(p->ring)) {
+            wait_nr = 1;
+            if (timeout > 0) {
+                double left = deadline - timeout_gettime();
+                if (left < 0.0)
+                    left = 0.0;
+                struct io_uring_sqe *sqe = uring_sqe(p->ring);
+                if (!sqe)
+                    return -1;
+                struct timespec t;
+                timeout_timespec(left, &t);
+                ts.tv_sec = t.tv_sec;
+                ts.tv_nsec = t.tv_nsec;
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (uint64_t)(uintptr_t)&ts;
+                sqe->len = 1;
+                sqe->off = 1;   // also completes on first other completion
+                sqe->user_data = URING_IGNORE;
+            }
+        }
+        if (uring_enter(p->ring, wait_nr) == -1)
+            return -1;
+
+        while (n < nevs && (cqe = uring_peek(p->ring))) {
+            uint64_t key = cqe->user_data;
+            int res = cqe->res;
+            int fd = (int)(uint32_t)key;
+            uring_seen(p->ring);
+
+            if (key == URING_IGNORE || fd >= p->nfds)
+                continue;
+            struct upoll *u = &p->fds[fd];
+            if (!u->armed || u->gen != (unsigned)(key >> 32))
+                continue;   // stale, fd was modified or removed since
+            u->armed = 0;
+
+            evs[n].ud = u->ud;
+            evs[n].events = 0;
+            if (res < 0) {
+                // let the waiters find out the error by themselves
+                evs[n].events = u->events;
+            } else {
+                if (res & (POLLIN | POLLHUP | POLLERR))
+                    evs[n].events |= POLLER_READ;
+                if (res & (POLLOUT | POLLHUP | POLLERR))
+                    evs[n].events |= POLLER_WRITE;
+                if (__uring_queue(p, fd) == -1)
+                    return -1;
+            }
+            n++;
+        }
+    } while (n == 0 && timeout != 0 &&
+             (timeout < 0 || timeout_gettime() < deadline));
+    return n;
+}
+
+/**
+ * Create a poller backed by io_uring if the kernel supports it, otherwise by
+ * epoll, like poller_create().
+ */
+struct poller *
+poller_create_ring(void)
+{
+    struct poller *p = poller_create();
+    if (!p)
+        return NULL;
+
+    struct uring *ring = malloc(sizeof(*ring));
+    if (ring && uring_init(ring, URING_ENTRIES) == 0) {
+        // io_uring is not disabled (ENOSYS, EPERM), drop epoll
+        close(p->epfd);
+        p->epfd = -1;
+        p->ring = ring;
+        p->fds = NULL;
+        p->nfds = 0;
+        p->queue = NULL;
+        p->nqueue = p->queuesize = 0;
+    } else {
+        free(ring);
+    }
+    return p;
+}
+
+#else
+
+struct poller *
+poller_create_ring(void)
+{
+    return poller_create();
+}
+
+#endif
+
+/**
+ * epoll_wait() with a nanosecond timeout, through epoll_pwait2(2) (Linux
+ * 5.11+). Older kernels get epoll_wait() and a timeout rounded up to ms.
+ */
+static int
+__poller_epoll_wait(struct poller *p, int nevs, double timeout, double deadline)
+{
+#if defined(SYS_epoll_pwait2)
+    static int unsupported;
+    if (!unsupported) {
+        struct timespec ts;
+        double left = __poller_left(timeout, deadline);
+        if (left >= 0)
+            timeout_timespec(left, &ts);
+        int n = syscall(SYS_epoll_pwait2, p->epfd, p->events, nevs,
+                        left >= 0 ? &ts : NULL, NULL, 0);
+        if (n != -1 || (errno != ENOSYS && errno != EPERM))
+            return n;
+        unsupported = 1;
+    }
+#endif
+    return epoll_wait(p->epfd, p->events, nevs, __poller_timeout(timeout, deadline));
+}
+
+static int
+__poller_ctl(struct poller *p, int op, int fd, int events, void *ud)
+{
+    struct epoll_event ev;
+    ev.events = 0;
+    if (events & POLLER_READ)
+        ev.events |= EPOLLIN;
+    if (events & POLLER_WRITE)
+        ev.events |= EPOLLOUT;
+    if (events & POLLER_EDGE)
+        ev.events |= EPOLLET;
+#if defined(EPOLLEXCLUSIVE)
+    if (events & POLLER_EXCLUSIVE)
+        ev.events |= EPOLLEXCLUSIVE;
+#endif
+    ev.data.ptr = ud;
+    return epoll_ctl(p->epfd, op, fd, &ev);
+}
+
+/**
+ * Register fd for given events.
+ */
+int
+poller_add(struct poller *p, int fd, int events, void *ud)
+{
+#if defined(POLLER_IO_URING)
+    if (p->ring)
+        return __uring_add(p, fd, events, ud);
+#endif
+    return __poller_ctl(p, EPOLL_CTL_ADD, fd, events, ud);
+}
+
+/**
+ * Change events of a registered fd.
+ */
+int
+poller_mod(struct poller *p, int fd, int events, void *ud)
+{
+#if defined(POLLER_IO_URING)
+    if (p->ring)
+        return __uring_mod(p, fd, events, ud);
+#endif
+    return __poller_ctl(p, EPOLL_CTL_MOD, fd, events, ud);
+}
+
+/**
+ * Unregister fd.
+ */
+int
+poller_del(struct poller *p, int fd)
+{
+    struct epoll_event ev;
+#if defined(POLLER_IO_URING)
+    if (p->ring)
+        return __uring_del(p, fd);
+#endif
+    return epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, &ev);
+}
+
+/**
+ * Wait for at most nevs ready events, up to timeout seconds.
+ *
+ * Returns the number of events stored in evs, 0 on timeout, -1 on error.
+ */
+int
+poller_wait(struct poller *p, struct poller_event *evs, int nevs,
+            double timeout)
+{
+    int i, n;
+    double deadline = timeout_gettime() + timeout;
+
+#if defined(POLLER_IO_URING)
+    if (p->ring)
+        return __uring_wait(p, evs, nevs, timeout);
+#endif
+    if (nevs > p->nevents) {
+        struct epoll_event *events = realloc(p->events, nevs * sizeof(*events));
+        if (!events)
+            return -1;
+        p->events = events;
+        p->nevents = nevs;
+    }
+
+    do {
+        n = __poller_epoll_wait(p, nevs, timeout, deadline);
+    } while (n == -1 && errno == EINTR);
+
+    for (i = 0; i < n; i++) {
+        uint32_t e = p->events[i].events;
+        evs[i].ud = p->events[i].data.ptr;
+        evs[i].events = 0;
+        if (e & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            evs[i].events |= POLLER_READ;
+        if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            evs[i].events |= POLLER_WRITE;
+    }
+    return n;
+}
+
+/**
+ * Called before fd is closed while registered. Closing fd is enough to
+ * remove it from epoll, but an io_uring poll request keeps the file open,
+ * so it is cancelled right away.
+ */
+void
+poller_closing(struct poller *p, int fd)
+{
+#if defined(POLLER_IO_URING)
+    if (p->ring && fd < p->nfds && p->fds[fd].events) {
+        p->fds[fd].events = 0;
+        if (p->fds[fd].armed && __uring_disarm(p, fd) == 0)
+            uring_enter(p->ring, 0);
+    }
+#else
+    (void)p;
+    (void)fd;
+#endif
+}
+
+/**
+ * Name of the mechanism backing the poller.
+ */
+const char *
+poller_backend(struct poller *p)
+{
+#if defined(POLLER_IO_URING)
+    if (p->ring)
+        return "io_uring";
+#else
+    (void)p;
+#endif
+    return "epoll";
+}
+
+/**
+ * Delete the poller.
+ */
+void
+poller_delete(struct poller *p)
+{
+#if defined(POLLER_IO_URING)
+    if (p->ring) {
+        uring_exit(p->ring);
+        free(p->ring);
+        free(p->fds);
+        free(p->queue);
+    }
+#endif
+    if (p->epfd != -1)
+        close(p->epfd);
+    free(p->events);
+    free(p);
+}
+
+#else
+#include <poll.h>
+
+struct poller {
+    struct pollfd *fds;
+    void **uds;
+    int nfds;
+    int size;
+};
+
+struct poller *
+poller_create(void)
+{
+    struct poller *p = calloc(1, sizeof(*p));
+    return p;
+}
+
+static int
+__poller_find(struct poller *p, int fd)
+{
+    int i;
+    for (i = 0; i < p->nfds; i++) {
+        if (p->fds[i].fd == fd)
+            return i;
+    }
+    return -1;
+}
+
+static short
+__poller_events(int events)
+{
+    short e = 0;
+    if (events & POLLER_READ)
+        e |= POLLIN;
+    if (events & POLLER_WRITE)
+        e |= POLLOUT;
+    return e;
+}
+
+int
+poller_add(struct poller *p, int fd, int events, void *ud)
+{
+    if (__poller_find(p, fd) != -1) {
+        errno = EEXIST;
+        return -1;
+    }
+    if (p->nfds == p->size) {
+        int size = p->size ? p->size * 2 : 16;
+        struct pollfd *fds = realloc(p->fds, size * sizeof(*fds));
+        if (!fds)
+            return -1;
+        p->fds = fds;
+        void **uds = realloc(p->uds, size * sizeof(*uds));
+        if (!uds)
+            return -1;
+        p->uds = uds;
+        p->size = size;
+    }
+    p->fds[p->nfds].fd = fd;
+    p->fds[p->nfds].events = __poller_events(events);
+    p->fds[p->nfds].revents = 0;
+    p->uds[p->nfds] = ud;
+    p->nfds++;
+    return 0;
+}
+
+int
+poller_mod(struct poller *p, int fd, int events, void *ud)
+{
+    int i = __poller_find(p, fd);
+    if (i == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    p->fds[i].events = __poller_events(events);
+    p->uds[i] = ud;
+    return 0;
+}
+
+int
+poller_del(struct poller *p, int fd)
+{
+    int i = __poller_find(p, fd);
+    if (i == -1) {
+        errno = ENOENT;
+        return -1;
+    }
+    p->nfds--;
+    p->fds[i] = p->fds[p->nfds];
+    p->uds[i] = p->uds[p->nfds];
+    return 0;
+}
+
+int
+poller_wait(struct poller *p, struct poller_event *evs, int nevs,
+            double timeout)
+{
+    int i, n, ret;
+    double deadline = timeout_gettime() + timeout;
+
+    do {
+        ret = poll(p->fds, p->nfds, __poller_timeout(timeout, deadline));
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret <= 0)
+        return ret;
+
+    for (i = 0, n = 0; i < p->nfds && n < nevs; i++) {
+        short e = p->fds[i].revents;
+        if (e & POLLNVAL) {
+            // fd was closed without being removed, forget it
+            poller_del(p, p->fds[i].fd);
+            i--;
+            continue;
+        }
+        if (!e)
+            continue;
+        evs[n].ud = p->uds[i];
+        evs[n].events = 0;
+        if (e & (POLLIN | POLLHUP | POLLERR))
+            evs[n].events |= POLLER_READ;
+        if (e & (POLLOUT | POLLHUP | POLLERR))
+            evs[n].events |= POLLER_WRITE;
+        n++;
+    }
+    return n;
+}
+
+struct poller *
+poller_create_ring(void)
+{
+    return poller_create();
+}
+
+void
+poller_closing(struct poller *p, int fd)
+{
+    // a closed fd would make poll() fail with POLLNVAL
+    poller_del(p, fd);
+}
+
+const char *
+poller_backend(struct poller *p)
+{
+    (void)p;
+    return "poll";
+}
+
+void
+poller_delete(struct poller *p)
+{
+    free(p->fds);
+    free(p->uds);
+    free(p);
+}
+
+#endif
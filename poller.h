@@ -0,0 +1,35 @@
+#ifndef POLLER_H
+#define POLLER_H
+/**
+ * Readiness notification on a persistent set of file descriptors.
+ *
+ * Uses epoll(7) on Linux, so the cost of poller_wait() depends on the number
+ * of ready descriptors only. Other platforms fall back to poll(2) over the
+ * registered set. When built with POLLER_IO_URING, poller_create_ring() uses
+ * io_uring(7) instead if the running kernel allows it.
+ */
+
+#define POLLER_READ     0x01
+#define POLLER_WRITE    0x02
+#define POLLER_EDGE     0x04    /* edge-triggered, ignored by poll fallback */
+#define POLLER_EXCLUSIVE 0x08   /* wake one of the pollers sharing fd, epoll only */
+
+struct poller_event {
+    void *ud;       /* user data given at registration */
+    int events;     /* POLLER_READ and/or POLLER_WRITE */
+};
+
+struct poller;
+
+struct poller *poller_create(void);
+struct poller *poller_create_ring(void);
+int poller_add(struct poller *p, int fd, int events, void *ud);
+int poller_mod(struct poller *p, int fd, int events, void *ud);
+int poller_del(struct poller *p, int fd);
+int poller_wait(struct poller *p, struct poller_event *evs, int nevs,
+                double timeout);
+void poller_closing(struct poller *p, int fd);
+const char *poller_backend(struct poller *p);
+void poller_delete(struct poller *p);
+
+#endif
@@ -0,0 +1,456 @@
+#include "compat.h"
+#include "resolver.h"
+#include "timeout.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#define RESOLVER_NBUCKETS   256
+
+struct entry {
+    struct entry *next;
+    int af;
+    int gaierr;                 /* 0 if resolved */
+    double expires;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+    char name[1];
+};
+
+struct resolver_query {
+    struct resolver_query *next;
+    int fd[2];                  /* written once the query is done */
+    int af;
+    int done;
+    int cancelled;
+    int gaierr;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+    char name[1];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* Cache and configuration, guarded by lock */
+static struct entry *buckets[RESOLVER_NBUCKETS];
+static unsigned long nentries;
+static unsigned long nhits;
+static unsigned long nmisses;
+static double ttl = RESOLVER_TTL;
+static double negttl = RESOLVER_NEGTTL;
+static int maxthreads = RESOLVER_THREADS;
+
+/* Worker pool, guarded by lock */
+static struct resolver_query *head, *tail;
+static int nthreads;
+static int nidle;
+
+static unsigned
+__resolver_hash(const char *name, int af)
+{
+    unsigned h = (unsigned)af;
+    while (*name)
+        h = h * 31 + (unsigned char)*name++;
+    return h % RESOLVER_NBUCKETS;
+}
+
+static void
+__resolver_flush(void)
+{
+    int i;
+    for (i = 0; i < RESOLVER_NBUCKETS; i++) {
+        while (buckets[i]) {
+            struct entry *e = buckets[i];
+            buckets[i] = e->next;
+            free(e);
+        }
+    }
+    nentries = 0;
+}
+
+/**
+ * Make room for a new entry: drop expired entries, or the one closest to
+ * expire if none. Called with lock held.
+ */
+static void
+__resolver_evict(double now)
+{
+    struct entry **pe, **oldest = NULL;
+    int i;
+    for (i = 0; i < RESOLVER_NBUCKETS; i++) {
+        pe = &buckets[i];
+        while (*pe) {
+            if ((*pe)->expires <= now) {
+                struct entry *e = *pe;
+                *pe = e->next;
+                free(e);
+                nentries--;
+                continue;
+            }
+            if (!oldest || (*pe)->expires < (*oldest)->expires)
+                oldest = pe;
+            pe = &(*pe)->next;
+        }
+    }
+    if (nentries >= RESOLVER_MAXENTRIES && oldest) {
+        struct entry *e = *oldest;
+        *oldest = e->next;
+        free(e);
+        nentries--;
+    }
+}
+
+/**
+ * Find an unexpired entry. Called with lock held.
+ */
+static struct entry *
+__resolver_find(const char *name, int af, double now)
+{
+    struct entry **pe = &buckets[__resolver_hash(name, af)];
+    while (*pe) {
+        struct entry *e = *pe;
+        if (e->af == af && strcmp(e->name, name) == 0) {
+            if (e->expires > now)
+                return e;
+            *pe = e->next;
+            free(e);
+            nentries--;
+            return NULL;
+        }
+        pe = &e->next;
+    }
+    return NULL;
+}
+
+/**
+ * Cache the result of a lookup. Called with lock held.
+ */
+static void
+__resolver_insert(const char *name, int af, int gaierr,
+                  struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    double now = timeout_gettime_coarse();
+    double t = gaierr ? negttl : ttl;
+    struct entry *e;
+
+    if (t <= 0)
+        return;
+    e = __resolver_find(name, af, now);
+    if (!e) {
+        if (nentries >= RESOLVER_MAXENTRIES)
+            __resolver_evict(now);
+        e = malloc(sizeof(*e) + strlen(name));
+        if (!e)
+            return;
+        strcpy(e->name, name);
+        e->af = af;
+        unsigned h = __resolver_hash(name, af);
+        e->next = buckets[h];
+        buckets[h] = e;
+        nentries++;
+    }
+    e->gaierr = gaierr;
+    e->expires = now + t;
+    e->addrlen = addrlen;
+    if (!gaierr)
+        memcpy(&e->addr, addr, addrlen);
+}
+
+/**
+ * Run getaddrinfo(), without lock held. Returns 0 or a gai error code.
+ */
+static int
+__resolver_getaddrinfo(const char *name, int af,
+                       struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    struct addrinfo hints, *res;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = af;
+    err = getaddrinfo(name, NULL, &hints, &res);
+    if (err)
+        return err;
+    *addrlen = res->ai_addrlen < sizeof(*addr) ? res->ai_addrlen : sizeof(*addr);
+    memcpy(addr, res->ai_addr, *addrlen);
+    freeaddrinfo(res);
+    return 0;
+}
+
+/**
+ * Set time to live of positive and negative cache entries, and the maximum
+ * number of worker threads. Negative values keep the current setting. The
+ * cache is flushed.
+ */
+void
+resolver_config(double newttl, double newnegttl, int newthreads)
+{
+    pthread_mutex_lock(&lock);
+    if (newttl >= 0)
+        ttl = newttl;
+    if (newnegttl >= 0)
+        negttl = newnegttl;
+    if (newthreads > 0) {
+        maxthreads = newthreads;
+        // let extra idle workers exit
+        pthread_cond_broadcast(&cond);
+    }
+    __resolver_flush();
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Look up name in cache.
+ *
+ * Returns 1 if found, with either the address copied to addr or *gaierr set
+ * to the cached error, 0 if not found.
+ */
+int
+resolver_cached(const char *name, int af, struct sockaddr *addr,
+                socklen_t *addrlen, int *gaierr)
+{
+    struct entry *e;
+    int found = 0;
+
+    pthread_mutex_lock(&lock);
+    e = __resolver_find(name, af, timeout_gettime_coarse());
+    if (e) {
+        nhits++;
+        found = 1;
+        *gaierr = e->gaierr;
+        if (!e->gaierr) {
+            if (e->addrlen < *addrlen)
+                *addrlen = e->addrlen;
+            memcpy(addr, &e->addr, *addrlen);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+/**
+ * Resolve name, blocking, and cache the result.
+ *
+ * Returns 0 or a gai error code.
+ */
+int
+resolver_lookup(const char *name, int af, struct sockaddr *addr,
+                socklen_t *addrlen)
+{
+    struct sockaddr_storage ss;
+    socklen_t sslen = 0;
+    int err;
+
+    if (resolver_cached(name, af, addr, addrlen, &err))
+        return err;
+
+    err = __resolver_getaddrinfo(name, af, &ss, &sslen);
+    pthread_mutex_lock(&lock);
+    nmisses++;
+    __resolver_insert(name, af, err, &ss, sslen);
+    pthread_mutex_unlock(&lock);
+    if (!err) {
+        if (sslen < *addrlen)
+            *addrlen = sslen;
+        memcpy(addr, &ss, *addrlen);
+    }
+    return err;
+}
+
+static void
+__resolver_free(struct resolver_query *q)
+{
+    close(q->fd[0]);
+    close(q->fd[1]);
+    free(q);
+}
+
+static void *
+__resolver_worker(void *arg)
+{
+    struct resolver_query *q;
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!head && nthreads <= maxthreads) {
+            nidle++;
+            pthread_cond_wait(&cond, &lock);
+            nidle--;
+        }
+        if (!head) {
+            // pool was shrunk
+            nthreads--;
+            break;
+        }
+        q = head;
+        head = q->next;
+        if (!head)
+            tail = NULL;
+        if (q->cancelled) {
+            __resolver_free(q);
+            continue;
+        }
+        nmisses++;
+        pthread_mutex_unlock(&lock);
+
+        q->gaierr = __resolver_getaddrinfo(q->name, q->af, &q->addr, &q->addrlen);
+
+        pthread_mutex_lock(&lock);
+        __resolver_insert(q->name, q->af, q->gaierr, &q->addr, q->addrlen);
+        q->done = 1;
+        if (q->cancelled) {
+            __resolver_free(q);
+        } else {
+            char c = 0;
+            while (write(q->fd[1], &c, 1) == -1 && errno == EINTR)
+                ;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * Start resolving name on a worker thread. The fd given by
+ * resolver_queryfd() becomes readable when it is done, then the result is
+ * taken by resolver_finish(), or the query dropped by resolver_cancel().
+ *
+ * Returns NULL on error, with errno set.
+ */
+struct resolver_query *
+resolver_start(const char *name, int af)
+{
+    struct resolver_query *q = malloc(sizeof(*q) + strlen(name));
+    int i;
+
+    if (!q)
+        return NULL;
+    if (pipe(q->fd) == -1) {
+        free(q);
+        return NULL;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(q->fd[i], F_SETFL, fcntl(q->fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(q->fd[i], F_SETFD, FD_CLOEXEC);
+    }
+    strcpy(q->name, name);
+    q->af = af;
+    q->done = 0;
+    q->cancelled = 0;
+    q->gaierr = 0;
+    q->addrlen = 0;
+    q->next = NULL;
+
+    pthread_mutex_lock(&lock);
+    if (nidle == 0 && nthreads < maxthreads) {
+        pthread_t tid;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&tid, &attr, __resolver_worker, NULL) == 0)
+            nthreads++;
+        pthread_attr_destroy(&attr);
+    }
+    if (nthreads == 0) {
+        pthread_mutex_unlock(&lock);
+        __resolver_free(q);
+        errno = EAGAIN;
+        return NULL;
+    }
+    if (tail)
+        tail->next = q;
+    else
+        head = q;
+    tail = q;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    return q;
+}
+
+/**
+ * File descriptor which becomes readable once the query is done.
+ */
+int
+resolver_queryfd(struct resolver_query *q)
+{
+    return q->fd[0];
+}
+
+/**
+ * Take the result of a query and free it.
+ *
+ * Returns 0 or a gai error code, or -1 with errno set to EAGAIN if the query
+ * is not done yet, in which case it is left as is.
+ */
+int
+resolver_finish(struct resolver_query *q, struct sockaddr *addr,
+                socklen_t *addrlen)
+{
+    int err;
+
+    pthread_mutex_lock(&lock);
+    if (!q->done) {
+        pthread_mutex_unlock(&lock);
+        errno = EAGAIN;
+        return -1;
+    }
+    pthread_mutex_unlock(&lock);
+
+    err = q->gaierr;
+    if (!err) {
+        if (q->addrlen < *addrlen)
+            *addrlen = q->addrlen;
+        memcpy(addr, &q->addr, *addrlen);
+    }
+    __resolver_free(q);
+    return err;
+}
+
+/**
+ * Drop a query, which is freed once its worker is done with it.
+ */
+void
+resolver_cancel(struct resolver_query *q)
+{
+    pthread_mutex_lock(&lock);
+    if (q->done) {
+        __resolver_free(q);
+    } else {
+        q->cancelled = 1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Get cache counters.
+ */
+void
+resolver_stats(struct resolver_stat *st)
+{
+    pthread_mutex_lock(&lock);
+    st->hits = nhits;
+    st->misses = nmisses;
+    st->entries = nentries;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Reset the worker pool in a child process, where the workers of the parent
+ * do not exist. Queries of the parent are forgotten.
+ */
+void
+resolver_forked(void)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+    head = tail = NULL;
+    nthreads = 0;
+    nidle = 0;
+}
@@ -0,0 +1,40 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+/**
+ * Host name resolution with a TTL cache, either blocking or by a small pool
+ * of worker threads running getaddrinfo(3).
+ *
+ * getaddrinfo() does not tell record TTLs, so successful lookups are cached
+ * for a fixed ttl and failed ones for negttl (in seconds).
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define RESOLVER_TTL        30.0
+#define RESOLVER_NEGTTL     5.0
+#define RESOLVER_THREADS    2
+#define RESOLVER_MAXENTRIES 1024
+
+struct resolver_query;
+
+struct resolver_stat {
+    unsigned long hits;         /* lookups answered from cache */
+    unsigned long misses;       /* lookups which called getaddrinfo() */
+    unsigned long entries;      /* cached names */
+};
+
+void resolver_config(double ttl, double negttl, int nthreads);
+int resolver_cached(const char *name, int af, struct sockaddr *addr,
+                    socklen_t *addrlen, int *gaierr);
+int resolver_lookup(const char *name, int af, struct sockaddr *addr,
+                    socklen_t *addrlen);
+struct resolver_query *resolver_start(const char *name, int af);
+int resolver_queryfd(struct resolver_query *q);
+int resolver_finish(struct resolver_query *q, struct sockaddr *addr,
+                    socklen_t *addrlen);
+void resolver_cancel(struct resolver_query *q);
+void resolver_stats(struct resolver_stat *st);
+void resolver_forked(void);
+
+#endif
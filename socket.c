@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
 #include <assert.h>
 #include <errno.h>
 
@@ -13,21 +15,38 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/sendfile.h>
+#endif
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
 #include "timeout.h"
 #include "buffer.h"
+#include "poller.h"
+#include "wheel.h"
+#include "resolver.h"
 
 #define _VERSION "0.0.1"
 
 #define TCPSOCK_TYPENAME     "TCPSOCKET*"
 #define UDPSOCK_TYPENAME     "UDPSOCKET*"
+#define POLLER_TYPENAME      "POLLER*"
+#define ADDRESS_TYPENAME     "ADDRESS*"
+#define DEADLINE_TYPENAME    "DEADLINE*"
 
 /* Socket address */
 typedef union {
@@ -39,12 +58,43 @@ typedef union {
 /* Convert "sockaddr_t" to "struct sockaddr *". */
 #define SAS2SA(x) (&((x)->sa))
 
+/* Address Object, see socket.address() */
+struct addrobj {
+    socklen_t addrlen;
+    sockaddr_t addr;
+};
+
+static const char addr_cache_key = 'k';
+static const char dns_key = 'k';
+
 /* Socket Object */
 struct sockobj {
     int fd;
     int sock_family;
     double sock_timeout;        /* in seconds */
-    struct buffer *buf;         /* used for buffer reading */
+    double deadline;            /* of attached deadline object, -1 if none */
+    double calldeadline;        /* given to the current call, -1 if none */
+    struct buffer buf;          /* used for buffer reading */
+    struct buffer wbuf;         /* used for buffered writing */
+    int pipefd[2];              /* pipe used by splice, or -1 */
+    size_t piped;               /* bytes spliced into pipe, not out yet */
+    size_t spliced;             /* bytes moved by a splice parked by scheduler */
+    size_t wbuf_watermark;      /* flush wbuf when it would reach this size */
+    size_t wsent;               /* bytes sent by a write parked by scheduler */
+    int connecting;             /* connect_start() in progress */
+    int connwaited;             /* was in progress when socket.connect_all()
+                                 * started waiting for it */
+    int fastopen;               /* listener: TCP_FASTOPEN enabled,
+                                 * client: data sent in SYN, not checked yet */
+    int connerr;                /* errno of failed connect_start(), -1 timeout */
+    int waited;                 /* current operation waited for the socket */
+    char *rdirect;              /* result of a direct read in progress,
+                                 * anchored in registry, or NULL */
+    size_t rdirect_size;        /* its size */
+    size_t rdirect_got;         /* bytes received into it */
+    size_t rsize;               /* bytes to make room for on each recv */
+    size_t rpending;            /* bytes left in socket by last recv */
+    int rsize_fixed;            /* rsize set by tcpsock:setreadbuffer() */
 };
 
 #define getsockobj(L) ((struct sockobj *)lua_touserdata(L, 1));
@@ -59,9 +109,66 @@ struct sockobj {
 #define OPT_TCP_NODELAY   "tcp_nodelay"
 #define OPT_TCP_KEEPALIVE "tcp_keepalive"
 #define OPT_TCP_REUSEADDR "tcp_reuseaddr"
+#define OPT_TCP_NOTSENT_LOWAT "tcp_notsent_lowat"
+#define OPT_TCP_USER_TIMEOUT "tcp_user_timeout"
+#define OPT_TCP_KEEPIDLE  "tcp_keepidle"
+#define OPT_TCP_KEEPINTVL "tcp_keepintvl"
+#define OPT_TCP_KEEPCNT   "tcp_keepcnt"
+#define OPT_TCP_QUICKACK  "tcp_quickack"
+#define OPT_TCP_DEFER_ACCEPT "tcp_defer_accept"
+#define OPT_SO_SNDBUF     "so_sndbuf"
+#define OPT_SO_RCVBUF     "so_rcvbuf"
+#define OPT_SO_BROADCAST  "so_broadcast"
+#define OPT_SO_REUSEPORT  "so_reuseport"
+#define OPT_SO_BUSY_POLL  "so_busy_poll"
+#define OPT_SO_PRIORITY   "so_priority"
+#define OPT_IP_TOS        "ip_tos"
+
+#define RECV_BUFSIZE 8192      /* initial recv size */
+#define RECV_MINSIZE 4096       /* smallest pooled buffer */
+#define RECV_MAXSIZE (1024 * 1024)
+#define RECV_DIRECT_MIN 65536   /* reads this large skip the read buffer */
+#define SPLICE_BUFSIZE 65536    /* default pipe capacity on Linux */
+#define DGRAM_MAXSIZE 65535     /* largest datagram payload */
+#define POLLER_MAXEVENTS 64
+#define IOV_STACKSIZE 16     /* iovec entries on stack before allocating */
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#define ACCEPT_MAX 64       /* default max connections by acceptmany call */
+#define MMSG_MAX 1024   /* max datagrams by recvmmsg/sendmmsg call */
 
-#define RECV_BUFSIZE 8192
+#if defined(__linux__)
+typedef struct mmsghdr mmsghdr_t;
+#else
+typedef struct {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+} mmsghdr_t;
+#endif
+
+/* Module statistics, see socket.stats() */
+static struct {
+    unsigned long io_fast;      /* I/O calls which succeeded at first try */
+    unsigned long io_waits;     /* I/O calls which would block and waited */
+    unsigned long pool_hits;    /* connects which reused a pooled connection */
+    unsigned long pool_misses;  /* connects which opened a new connection */
+    unsigned long tfo_connects; /* connects with fast open data */
+    unsigned long tfo_syn_data; /* ... which sent it in SYN (had a cookie) */
+    unsigned long tfo_syn_acked;/* ... which the server accepted */
+    unsigned long tfo_accepts;  /* accepted connections with data in SYN */
+} stats;
+
+/* Poller Object */
+struct pollerobj {
+    struct poller *poller;
+    struct poller_event *events;
+    int nevents;
+};
 
+#if !defined(__linux__)
 /**
  * Function to perform the setting of socket blocking mode.
  */
@@ -76,39 +183,447 @@ __setblocking(int fd, int block)
     }
     fcntl(fd, F_SETFL, flags);
 }
+#endif
+
+#define EVENT_NONE      0
+#define EVENT_READABLE  POLLIN
+#define EVENT_WRITABLE  POLLOUT
+#define EVENT_ANY       (POLLIN | POLLOUT)
+
+/*** Cooperative scheduler ***
+ *
+ * Coroutines created by socket.spawn() are managed by the scheduler. When a
+ * socket method called from a managed coroutine would block, the coroutine is
+ * parked on the fd instead of blocking the whole Lua state in poll(), and
+ * socket.run() resumes it once the fd is ready or its deadline expires.
+ *
+ * Parked coroutines are resumed by calling the socket method again (its
+ * continuation), so blocking methods must be restartable: any progress has to
+ * be kept in the socket object, and the deadline is restored by
+ * __sockobj_inittimeout().
+ */
+
+/* Lua 5.3 changed lua_yieldk() and lua_resume() signatures. */
+#if LUA_VERSION_NUM >= 503
+static int
+__sched_k(lua_State *L, int status, lua_KContext ctx)
+{
+    (void)status;
+    return ((lua_CFunction)ctx)(L);
+}
+#define __yieldk(L, k)  lua_yieldk(L, 0, (lua_KContext)(k), __sched_k)
+#define __yieldable(L)  lua_isyieldable(L)
+#else
+#define __yieldk(L, k)  lua_yieldk(L, 0, 0, k)
+#define __yieldable(L)  1
+#endif
+
+#if LUA_VERSION_NUM >= 504
+#define __resume(co, from, nargs, nres) lua_resume(co, from, nargs, nres)
+#else
+static int
+__resume(lua_State *co, lua_State *from, int nargs, int *nres)
+{
+    int status = lua_resume(co, from, nargs);
+    *nres = lua_gettop(co);
+    return status;
+}
+#endif
+
+#define SCHED_TYPENAME      "SCHEDULER*"
+#define TIMER_TYPENAME      "TIMER*"
+#define SCHED_MAXEVENTS     256
+
+/* A coroutine waiting to run, or parked on a fd */
+struct waiter {
+    lua_State *co;
+    int nargs;                  /* number of arguments to resume with */
+    int fd;                     /* -1 if not parked on a fd */
+    int event;
+    struct timeout tm;
+    struct wheel_timer timer;   /* pending if tm has a deadline */
+    struct timerobj *owner;     /* handle of a socket.timer(), if any */
+    struct waiter *sibling;     /* ring of waiters of a coroutine parked on
+                                 * several fds, NULL if alone */
+};
+
+/* Handle of a coroutine started by socket.timer() */
+struct timerobj {
+    struct waiter *w;           /* NULL once fired or cancelled */
+};
+
+/* Waiters of a fd, one reader and one writer at most */
+struct fdslot {
+    struct waiter *rd;
+    struct waiter *wr;
+    int events;                 /* events registered in poller */
+};
+
+struct sched {
+    struct poller *poller;
+    struct poller_event *events;
+    struct fdslot *slots;       /* indexed by fd */
+    int nslots;
+    struct wheel *wheel;        /* deadlines of parked waiters */
+    struct waiter **runq;       /* waiters ready to be resumed */
+    int nrunq;
+    int runqsize;
+    lua_State *current;         /* coroutine being resumed */
+    struct waiter *resumed;     /* waiter being resumed */
+    int parked;                 /* current coroutine parked itself */
+    int nthreads;               /* live managed coroutines */
+    int running;
+};
+
+static const char sched_key = 'k';
+
+/**
+ * Get the scheduler of this Lua state, NULL if not created yet.
+ */
+static struct sched *
+__sched_get(lua_State *L)
+{
+    struct sched *sc;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &sched_key);
+    sc = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return sc;
+}
+
+/**
+ * Get the scheduler if L is the managed coroutine it is running, and it can
+ * yield.
+ */
+static struct sched *
+__sched_current(lua_State *L)
+{
+    struct sched *sc = __sched_get(L);
+    if (sc && sc->current == L && __yieldable(L))
+        return sc;
+    return NULL;
+}
+
+static int
+__sched_grow(void **array, int *size, int need, size_t elemsize)
+{
+    if (need <= *size)
+        return 0;
+    int newsize = *size ? *size : 16;
+    while (newsize < need)
+        newsize *= 2;
+    void *p = realloc(*array, newsize * elemsize);
+    if (!p)
+        return -1;
+    *array = p;
+    *size = newsize;
+    return 0;
+}
+
+static struct waiter *
+__sched_newwaiter(lua_State *co, int nargs)
+{
+    struct waiter *w = malloc(sizeof(*w));
+    if (!w)
+        return NULL;
+    w->co = co;
+    w->nargs = nargs;
+    w->fd = -1;
+    w->event = EVENT_NONE;
+    w->tm.tm_timeout = -1;
+    w->tm.tm_deadline = -1;
+    w->timer.pprev = NULL;
+    w->timer.ud = w;
+    w->owner = NULL;
+    w->sibling = NULL;
+    return w;
+}
+
+static int
+__sched_enqueue(struct sched *sc, struct waiter *w)
+{
+    if (__sched_grow((void **)&sc->runq, &sc->runqsize, sc->nrunq + 1,
+                     sizeof(*sc->runq)) == -1)
+        return -1;
+    sc->runq[sc->nrunq++] = w;
+    return 0;
+}
+
+/**
+ * Update events registered in poller according to waiters of fd.
+ */
+static int
+__sched_register(struct sched *sc, int fd)
+{
+    struct fdslot *slot = &sc->slots[fd];
+    int events = 0;
+    int ret = 0;
+    if (slot->rd)
+        events |= POLLER_READ;
+    if (slot->wr)
+        events |= POLLER_WRITE;
+    if (events == slot->events)
+        return 0;
+
+    void *ud = (void *)(intptr_t)fd;
+    if (events == 0) {
+        ret = poller_del(sc->poller, fd);
+    } else if (slot->events == 0) {
+        ret = poller_add(sc->poller, fd, events, ud);
+        if (ret == -1 && CHECK_ERRNO(EEXIST))
+            ret = poller_mod(sc->poller, fd, events, ud);
+    } else {
+        ret = poller_mod(sc->poller, fd, events, ud);
+        if (ret == -1 && CHECK_ERRNO(ENOENT))
+            ret = poller_add(sc->poller, fd, events, ud);
+    }
+    slot->events = (ret == -1 && events != 0) ? 0 : events;
+    return ret;
+}
+
+/**
+ * Remove a waiter from its fd slot and from the wheel.
+ */
+static void
+__sched_unlink(struct sched *sc, struct waiter *w)
+{
+    if (w->fd >= 0) {
+        struct fdslot *slot = &sc->slots[w->fd];
+        if (slot->rd == w)
+            slot->rd = NULL;
+        if (slot->wr == w)
+            slot->wr = NULL;
+    }
+    wheel_del(sc->wheel, &w->timer);
+}
+
+/**
+ * Make a parked waiter runnable.
+ */
+static void
+__sched_wake(struct sched *sc, struct waiter *w)
+{
+    __sched_unlink(sc, w);
+    // a coroutine parked on several fds runs once, drop its other waiters
+    while (w->sibling && w->sibling != w) {
+        struct waiter *o = w->sibling;
+        w->sibling = o->sibling;
+        __sched_unlink(sc, o);
+        __sched_register(sc, o->fd);
+        free(o);
+    }
+    w->sibling = NULL;
+    if (__sched_enqueue(sc, w) == -1) {
+        // out of memory, nothing sensible left to do
+        abort();
+    }
+}
+
+/**
+ * Park the running coroutine until one of nfds fds is ready for its events
+ * (EVENT_READABLE or EVENT_WRITABLE), or tm expires. When resumed, the
+ * coroutine continues by calling k.
+ *
+ * Does not return, unless on error (returns -1 with errno set).
+ */
+static int
+__sched_parkmany(lua_State *L, struct sched *sc, const struct pollfd *fds,
+                 int nfds, struct timeout *tm, lua_CFunction k)
+{
+    struct fdslot *slot;
+    struct waiter *w, *first = NULL;
+    int i, err;
+
+    for (i = 0; i < nfds; i++) {
+        int fd = fds[i].fd;
+        int event = fds[i].events;
+        if (fd >= sc->nslots) {
+            int nslots = sc->nslots;
+            if (__sched_grow((void **)&sc->slots, &sc->nslots, fd + 1,
+                             sizeof(*sc->slots)) == -1)
+                goto err;
+            memset(sc->slots + nslots, 0, (sc->nslots - nslots) * sizeof(*sc->slots));
+        }
+        slot = &sc->slots[fd];
+        w = event == EVENT_READABLE ? slot->rd : slot->wr;
+        if (w && w->co == L) {
+            // fd given twice
+            continue;
+        } else if (w) {
+            // only one coroutine may wait for each direction of a socket
+            errno = EBUSY;
+            goto err;
+        }
+
+        w = __sched_newwaiter(L, 0);
+        if (!w)
+            goto err;
+        w->fd = fd;
+        w->event = event;
+        w->tm = *tm;
+        if (event == EVENT_READABLE)
+            slot->rd = w;
+        else
+            slot->wr = w;
+        if (first) {
+            w->sibling = first->sibling;
+            first->sibling = w;
+        } else {
+            // the first waiter holds the deadline for all of them
+            first = w;
+            w->sibling = w;
+            if (tm->tm_timeout > 0)
+                wheel_add(sc->wheel, &w->timer, tm->tm_deadline);
+        }
+        if (__sched_register(sc, fd) == -1)
+            goto err;
+    }
+
+    sc->parked = 1;
+    return __yieldk(L, k);
+
+err:
+    err = errno;
+    if (first) {
+        while (first->sibling != first) {
+            w = first->sibling;
+            first->sibling = w->sibling;
+            __sched_unlink(sc, w);
+            __sched_register(sc, w->fd);
+            free(w);
+        }
+        __sched_unlink(sc, first);
+        __sched_register(sc, first->fd);
+        free(first);
+    }
+    errno = err;
+    return -1;
+}
+
+/**
+ * Park the running coroutine on fd until it is ready for event or tm expires.
+ * With fd -1, only wait for tm to expire. When resumed, the coroutine
+ * continues by calling k.
+ *
+ * Does not return, unless on error (returns -1 with errno set).
+ */
+static int
+__sched_park(lua_State *L, struct sched *sc, int fd, int event,
+             struct timeout *tm, lua_CFunction k)
+{
+    struct waiter *w;
+
+    if (fd < 0) {
+        w = __sched_newwaiter(L, 0);
+        if (!w)
+            return -1;
+        w->tm = *tm;
+        wheel_add(sc->wheel, &w->timer, tm->tm_deadline);
+        sc->parked = 1;
+        return __yieldk(L, k);
+    }
+
+    struct pollfd pollfd;
+    pollfd.fd = fd;
+    pollfd.events = event;
+    return __sched_parkmany(L, sc, &pollfd, 1, tm, k);
+}
+
+/**
+ * Called when fd is going to be closed: resume its waiters, which will see
+ * the socket closed.
+ */
+static void
+__sched_closefd(lua_State *L, int fd)
+{
+    struct sched *sc = __sched_get(L);
+    if (!sc || fd >= sc->nslots)
+        return;
+    struct fdslot *slot = &sc->slots[fd];
+    if (slot->rd)
+        __sched_wake(sc, slot->rd);
+    if (slot->wr)
+        __sched_wake(sc, slot->wr);
+    if (slot->events)
+        poller_closing(sc->poller, fd);
+    slot->events = 0;
+}
+
+/**
+ * Check whether a coroutine is parked waiting for event on fd.
+ */
+static int
+__sched_waiting(lua_State *L, int fd, int event)
+{
+    struct sched *sc = __sched_get(L);
+    if (!sc || fd < 0 || fd >= sc->nslots)
+        return 0;
+    if (event == EVENT_READABLE)
+        return sc->slots[fd].rd != NULL;
+    return sc->slots[fd].wr != NULL;
+}
+
+/**
+ * poll(2) with a timeout in seconds, negative to wait forever. Uses ppoll(2)
+ * where available, which takes a timespec: waits shorter than 1 ms are not
+ * truncated into busy polling.
+ */
+static int
+__poll(struct pollfd *fds, nfds_t nfds, double timeout)
+{
+#if defined(__linux__)
+    struct timespec ts;
+    if (timeout >= 0)
+        timeout_timespec(timeout, &ts);
+    return ppoll(fds, nfds, timeout >= 0 ? &ts : NULL, NULL);
+#else
+    return poll(fds, nfds, timeout_ms(timeout));
+#endif
+}
 
 /**
  * Do a event polling on the socket, if necessary (sock_timeout > 0).
  *
+ * If called from a managed coroutine and a continuation k is given, the
+ * coroutine is parked instead of blocking, and k is called when resumed.
+ * Callers try the operation first and only wait after EAGAIN, so the
+ * continuation simply tries again.
+ *
  * Returns:
  *  1   on timeout
  *  -1  on error
  *  0   success
  */
-#define EVENT_NONE      0
-#define EVENT_READABLE  POLLIN
-#define EVENT_WRITABLE  POLLOUT
-#define EVENT_ANY       (POLLIN | POLLOUT)
 static int
-__waitfd(struct sockobj *s, int event, struct timeout *tm)
+__waitfd(lua_State *L, struct sockobj *s, int event, struct timeout *tm, lua_CFunction k)
 {
     int ret;
+    struct sched *sc;
 
     // Nothing to do if socket is closed.
     if (s->fd < 0)
         return 0;
+    s->waited = 1;
 
     struct pollfd pollfd;
     pollfd.fd = s->fd;
     pollfd.events = event;
 
+    if (k && (sc = __sched_current(L)) != NULL) {
+        if (timeout_left(tm) == 0.0)
+            return 1;
+        // tm keeps it for the continuation, which may not be the method
+        // that set it and would not clear it
+        s->calldeadline = -1;
+        __sched_park(L, sc, s->fd, event, tm, k);
+        return -1;
+    }
+
     do {
         // Handling this condition here simplifies the loops.
         double left = timeout_left(tm);
         if (left == 0.0)
             return 1;
-        int timeout = (int)(left * 1e3);
-        ret = poll(&pollfd, 1, timeout >= 0 ? timeout : -1);
+        ret = __poll(&pollfd, 1, left);
     } while (ret == -1 && CHECK_ERRNO(EINTR));
 
     if (ret < 0) {
@@ -161,15 +676,149 @@ __getsockaddrlen(struct sockobj *s, socklen_t * len_ret)
     }
 }
 
-/* 
+/**
+ * Take the result of the name resolution a managed coroutine was parked on,
+ * if any.
+ *
+ * Returns 1 if there was one, with either the address copied to addr_ret or
+ * *gaierr set (-1 if it timed out), 0 otherwise.
+ */
+static int
+__sockobj_resolved(lua_State *L, struct sched *sc, struct sockaddr *addr_ret,
+                   socklen_t *len_ret, int *gaierr)
+{
+    struct resolver_query *q;
+    int fd;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &dns_key);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pushthread(L);
+    lua_rawget(L, -2);
+    q = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (!q) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pushthread(L);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    fd = resolver_queryfd(q);
+    if (sc->resumed && sc->resumed->fd == fd)
+        sc->resumed = NULL;
+    __sched_closefd(L, fd);
+    *gaierr = resolver_finish(q, addr_ret, len_ret);
+    if (*gaierr == -1) {
+        // woken by deadline
+        resolver_cancel(q);
+    }
+    return 1;
+}
+
+/**
+ * Init the timeout of a new socket operation: sock_timeout, cut short by the
+ * deadline attached to the socket and the one given to the call if any.
+ */
+static void
+__sockobj_timeout(struct sockobj *s, struct timeout *tm)
+{
+    timeout_init(tm, s->sock_timeout);
+    if (s->deadline >= 0)
+        timeout_clamp(tm, s->deadline);
+    if (s->calldeadline >= 0)
+        timeout_clamp(tm, s->calldeadline);
+}
+
+/**
+ * Get the time of the deadline object at index idx, or -1 if there is none.
+ */
+static double
+__deadline_opt(lua_State *L, int idx)
+{
+    double *d = (double *)luaL_testudata(L, idx, DEADLINE_TYPENAME);
+    return d ? *d : -1;
+}
+
+/**
+ * Call f with deadline (-1 if none) bounding the operations of s it starts.
+ * It is not attached to s: once parked, the timeout of the waiter keeps it
+ * (see __waitfd).
+ */
+static int
+__sockobj_withdeadline(lua_State *L, struct sockobj *s, double deadline, lua_CFunction f)
+{
+    int ret;
+    s->calldeadline = deadline;
+    ret = f(L);
+    s->calldeadline = -1;
+    return ret;
+}
+
+/**
+ * Park the managed coroutine until name is resolved by a worker thread, or
+ * timeout expires. When resumed, k is called again and finds the result with
+ * __sockobj_resolved().
+ *
+ * Does not return, unless on error (returns -1).
+ */
+static int
+__sockobj_resolve(lua_State *L, struct sched *sc, const char *name, int af,
+                  double timeout, lua_CFunction k)
+{
+    struct resolver_query *q = resolver_start(name, af);
+    struct timeout tm;
+
+    if (!q)
+        return -1;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &dns_key);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "k");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &dns_key);
+    }
+    lua_pushthread(L);
+    lua_pushlightuserdata(L, q);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    timeout_init(&tm, timeout);
+    if (__sched_park(L, sc, resolver_queryfd(q), EVENT_READABLE, &tm, k) == -1) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, &dns_key);
+        lua_pushthread(L);
+        lua_pushnil(L);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+        resolver_cancel(q);
+        return -1;
+    }
+    return 0;
+}
+
+/**
  * Convert a string specifying a host name or one of a few symbolic names to a
  * numeric IP address.
+ *
+ * Names are looked up in the resolver cache first. On a miss, a managed
+ * coroutine given a continuation k is parked while a worker thread resolves
+ * the name (up to timeout seconds), other callers block in getaddrinfo().
  */
 static int
-__sockobj_setipaddr(lua_State *L, const char *name, struct sockaddr *addr_ret, size_t addr_ret_size, int af)
+__sockobj_setipaddr(lua_State *L, const char *name, struct sockaddr *addr_ret,
+                    size_t addr_ret_size, int af, double timeout, lua_CFunction k)
 {
-    struct addrinfo hints, *res;
-    int err;
+    struct sched *sc;
+    socklen_t len = addr_ret_size;
+    int err = 0;
     int d1, d2, d3, d4;
     char ch;
     memset((void *)addr_ret, 0, addr_ret_size);
@@ -186,49 +835,160 @@ __sockobj_setipaddr(lua_State *L, const char *name, struct sockaddr *addr_ret, s
         return 0;
     }
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = af;
-    err = getaddrinfo(name, NULL, &hints, &res);
+    sc = k ? __sched_current(L) : NULL;
+    if (sc && __sockobj_resolved(L, sc, addr_ret, &len, &err)) {
+        if (err == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, ERROR_TIMEOUT);
+            return -1;
+        }
+    } else if (!resolver_cached(name, af, addr_ret, &len, &err)) {
+        if (!sc || __sockobj_resolve(L, sc, name, af, timeout, k) == -1) {
+            // not managed, or no worker available: resolve in place
+            err = resolver_lookup(name, af, addr_ret, &len);
+        }
+    }
     if (err) {
         lua_pushnil(L);
-        lua_pushstring(L, gai_strerror(errno));
+        lua_pushstring(L, gai_strerror(err));
         return -1;
     }
-    if (res->ai_addrlen < addr_ret_size)
-        addr_ret_size = res->ai_addrlen;
-    memcpy((char *)addr_ret, res->ai_addr, addr_ret_size);
-    freeaddrinfo(res);
     return 0;
 }
 
 /**
- * Parse socket address arguments.
+ * Push the address object of a socket address.
  *
- * Socket addresses are represented as follows:
+ * Address objects are interned in a weak table keyed by the raw address, so
+ * the same address always gives the same object, which can be compared or
+ * used as a table key directly.
+ */
+static struct addrobj *
+__addrobj_push(lua_State *L, struct sockaddr *addr, socklen_t addrlen)
+{
+    struct addrobj *a;
+    if (addrlen > sizeof(sockaddr_t))
+        addrlen = sizeof(sockaddr_t);
 
- *  - A single string is used for the AF_UNIX address family.
- *  - Two arguments (host, port) is used for the AF_INET address family,
- *    where host is a string representing either a hostname in Internet Domain
- *    Notation like 'www.example.com' or an IPv4 address like '8.8.8.8', and port
- *    is an number.
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &addr_cache_key);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &addr_cache_key);
+    }
+    lua_pushlstring(L, (const char *)addr, addrlen);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+    if (!lua_isnil(L, -1)) {
+        a = lua_touserdata(L, -1);
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+        return a;
+    }
+    lua_pop(L, 1);
 
- * If you use a hostname in the host portion of IPv4/IPv6 socket address, the
- * program may show a nondeterministic behavior, as we use the first address
- * returned from the DNS resolution. The socket address will be resolved
- * differently into an actual IPv4/v6 address, depending on the results from DNS
- * resolution and/or the host configuration. For deterministic behavior use a
- * numeric address in host portion.
- *
- * This method assumed that address arguments start after offset index.
+    a = (struct addrobj *)lua_newuserdata(L, sizeof(struct addrobj));
+    memset(&a->addr, 0, sizeof(a->addr));
+    memcpy(&a->addr, addr, addrlen);
+    a->addrlen = addrlen;
+    luaL_setmetatable(L, ADDRESS_TYPENAME);
+    lua_pushvalue(L, -1);       /* cache, key, a, a */
+    lua_insert(L, -3);          /* cache, a, key, a */
+    lua_rawset(L, -4);          /* cache, a */
+    lua_replace(L, -2);
+    return a;
+}
+
+/**
+ * Copy the socket address of address object at index idx, if any.
  *
- * Returns 0 on success, -1 on failure.
+ * Returns 1 if it is an address object, 0 otherwise.
+ */
+static int
+__addrobj_get(lua_State *L, int idx, struct sockaddr *addr_ret, socklen_t *len_ret)
+{
+    struct addrobj *a = luaL_testudata(L, idx, ADDRESS_TYPENAME);
+    if (!a)
+        return 0;
+    memcpy(addr_ret, &a->addr, a->addrlen);
+    *len_ret = a->addrlen;
+    return 1;
+}
+
+/**
+ * Set socket address from host and port (AF_INET), or from a path (AF_UNIX) if
+ * port is -1. Callers check that a port given by user is in range. The family of the socket object is set accordingly.
+ * Host names may park a managed coroutine, which resumes by calling k again
+ * (see __sockobj_setipaddr).
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+__sockobj_setaddr(lua_State * L, struct sockobj *s, const char *host, int port,
+                  struct sockaddr *addr_ret, socklen_t * len_ret, lua_CFunction k)
+{
+    if (port != -1) {
+        struct sockaddr_in *addr = (struct sockaddr_in *)addr_ret;
+        struct timeout tm;
+        __sockobj_timeout(s, &tm);
+        s->sock_family = AF_INET;
+        if (__sockobj_setipaddr(L, host, (struct sockaddr *)addr, sizeof(*addr),
+                                AF_INET, tm.tm_timeout, k) != 0) {
+            return -1;
+        }
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(port);
+        *len_ret = sizeof(*addr);
+    } else {
+        struct sockaddr_un *addr = (struct sockaddr_un *)addr_ret;
+        s->sock_family = AF_UNIX;
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, host, sizeof(addr->sun_path) - 1);
+        *len_ret = sizeof(*addr);
+    }
+    return 0;
+}
+
+/**
+ * Parse socket address arguments.
+ *
+ * Socket addresses are represented as follows:
+
+ *  - A single string is used for the AF_UNIX address family.
+ *  - Two arguments (host, port) is used for the AF_INET address family,
+ *    where host is a string representing either a hostname in Internet Domain
+ *    Notation like 'www.example.com' or an IPv4 address like '8.8.8.8', and port
+ *    is an number.
+ *  - An address object (see socket.address) of either family.
+
+ * If you use a hostname in the host portion of IPv4/IPv6 socket address, the
+ * program may show a nondeterministic behavior, as we use the first address
+ * returned from the DNS resolution. The socket address will be resolved
+ * differently into an actual IPv4/v6 address, depending on the results from DNS
+ * resolution and/or the host configuration. For deterministic behavior use a
+ * numeric address in host portion.
+ *
+ * This method assumed that address arguments start after offset index, and
+ * may be followed by a table of options. k is the calling method, restarted
+ * after a host name was resolved.
+ *
+ * Returns 0 on success, -1 on failure.
  */
 static int
 __sockobj_getaddrfromarg(lua_State * L, struct sockobj *s, struct sockaddr *addr_ret,
-                     socklen_t * len_ret, int offset)
+                     socklen_t * len_ret, int offset, lua_CFunction k)
 {
     int n;
     n = lua_gettop(L);
+    if (n > 1 + offset && lua_type(L, n) == LUA_TTABLE) {
+        // trailing options table
+        n--;
+    }
     if (n != 1 + offset && n != 2 + offset) {
         lua_pushnil(L);
         lua_pushfstring(L, "expecting %d or %d arguments"
@@ -236,33 +996,76 @@ __sockobj_getaddrfromarg(lua_State * L, struct sockobj *s, struct sockaddr *addr
         return -1;
     }
 
-    if (n == 2 + offset) {
-        s->sock_family = AF_INET;
-    } else if (n == 1 + offset) {
-        s->sock_family = AF_UNIX;
+    if (n == 1 + offset && __addrobj_get(L, 1 + offset, addr_ret, len_ret)) {
+        s->sock_family = addr_ret->sa_family;
+        return 0;
     }
-    if (s->sock_family == AF_INET) {
-        struct sockaddr_in *addr = (struct sockaddr_in *)addr_ret;
-        const char *host;
-        int port;
-        host = luaL_checkstring(L, 1 + offset);
-        port = luaL_checknumber(L, 2 + offset);
-        if (__sockobj_setipaddr(L, host, (struct sockaddr *)addr, sizeof(*addr), AF_INET) != 0) {
+    if (n == 2 + offset && !lua_isnil(L, 2 + offset)) {
+        lua_Integer port = luaL_checkinteger(L, 2 + offset);
+        luaL_argcheck(L, port >= 0 && port <= 65535, 2 + offset, "port out of range");
+        return __sockobj_setaddr(L, s, luaL_checkstring(L, 1 + offset), port,
+                                 addr_ret, len_ret, k);
+    }
+    return __sockobj_setaddr(L, s, luaL_checkstring(L, 1 + offset), -1,
+                             addr_ret, len_ret, k);
+}
+
+/**
+ * Get the index of the options table following address arguments starting
+ * after offset, or 0 if none.
+ */
+static int
+__sockobj_optsarg(lua_State *L, int offset)
+{
+    int n = lua_gettop(L);
+    if (n > 1 + offset && lua_type(L, n) == LUA_TTABLE)
+        return n;
+    return 0;
+}
+
+/**
+ * Parse socket address from elements first and first + 1 of table at index
+ * idx, in the same forms as __sockobj_getaddrfromarg.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+__sockobj_getaddrfromtable(lua_State * L, struct sockobj *s, int idx, int first,
+                           struct sockaddr *addr_ret, socklen_t * len_ret)
+{
+    int ret, port = -1;
+    lua_rawgeti(L, idx, first);
+    if (__addrobj_get(L, -1, addr_ret, len_ret)) {
+        lua_pop(L, 1);
+        s->sock_family = addr_ret->sa_family;
+        return 0;
+    }
+    lua_rawgeti(L, idx, first + 1);
+    if (!lua_isstring(L, -2) || !(lua_isnil(L, -1) || lua_isnumber(L, -1))) {
+        lua_pop(L, 2);
+        lua_pushnil(L);
+        lua_pushstring(L, "bad address");
+        return -1;
+    }
+    if (!lua_isnil(L, -1)) {
+        lua_Integer p = lua_tointeger(L, -1);
+        if (p < 0 || p > 65535) {
+            lua_pop(L, 2);
+            lua_pushnil(L);
+            lua_pushstring(L, "port out of range");
             return -1;
         }
-        addr->sin_family = AF_INET;
-        addr->sin_port = htons(port);
-        *len_ret = sizeof(*addr);
-    } else if (s->sock_family == AF_UNIX) {
-        struct sockaddr_un *addr = (struct sockaddr_un *)addr_ret;
-        const char *path = luaL_checkstring(L, 1 + offset);
-        addr->sun_family = AF_UNIX;
-        strncpy(addr->sun_path, path, sizeof(addr->sun_path) - 1);
-        *len_ret = sizeof(*addr);
+        port = p;
+    }
+    ret = __sockobj_setaddr(L, s, lua_tostring(L, -2), port, addr_ret, len_ret, NULL);
+    if (ret == -1) {
+        // keep error message on top
+        lua_remove(L, -3);
+        lua_remove(L, -3);
     } else {
-        assert(0);
+        lua_pop(L, 2);
     }
-    return 0;
+    return ret;
 }
 
 /**
@@ -289,9 +1092,8 @@ __sockobj_makeaddr(lua_State * L, struct sockobj *s, struct sockaddr *addr,
             int err = getnameinfo(addr, addrlen, buf, sizeof(buf), NULL, 0,
                                   NI_NUMERICHOST);
             if (err) {
-                err = errno;
                 lua_pushnil(L);
-                lua_pushstring(L, gai_strerror(errno));
+                lua_pushstring(L, gai_strerror(err));
                 return -1;
             }
             lua_pushnumber(L, 1);
@@ -305,6 +1107,7 @@ __sockobj_makeaddr(lua_State * L, struct sockobj *s, struct sockaddr *addr,
     case AF_UNIX:
         {
             struct sockaddr_un *a = (struct sockaddr_un *)addr;
+            lua_pop(L, 1);  /* path is returned as a string */
 #ifdef linux
             if (a->sun_path[0] == 0) { /* Linux abstract namespace */
                 addrlen -= offset(struct sockaddr_un, sun_path);
@@ -343,8 +1146,28 @@ __sockobj_create(lua_State *L, const char *tname)
     }
     s->fd = -1;
     s->sock_timeout = -1;
+    s->deadline = -1;
+    s->calldeadline = -1;
     s->sock_family = 0;
-    s->buf = NULL;
+    buffer_init(&s->buf);
+    buffer_init(&s->wbuf);
+    s->pipefd[0] = -1;
+    s->pipefd[1] = -1;
+    s->piped = 0;
+    s->spliced = 0;
+    s->wbuf_watermark = 0;
+    s->wsent = 0;
+    s->connecting = 0;
+    s->connwaited = 0;
+    s->connerr = 0;
+    s->waited = 0;
+    s->fastopen = 0;
+    s->rdirect = NULL;
+    s->rdirect_size = 0;
+    s->rdirect_got = 0;
+    s->rsize = RECV_BUFSIZE;
+    s->rpending = 0;
+    s->rsize_fixed = 0;
     luaL_setmetatable(L, tname);
     return s;
 }
@@ -358,19 +1181,109 @@ __sockobj_createsocket(lua_State *L, struct sockobj *s, int type)
     int fd;
     assert(s->fd == -1);
 
-    if ((fd = socket(s->sock_family, type, 0)) == -1) {
+    // 100% non-blocking
+#if defined(__linux__)
+    fd = socket(s->sock_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#else
+    fd = socket(s->sock_family, type, 0);
+    if (fd != -1) {
+        __setblocking(fd, 0);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if (fd == -1) {
         lua_pushnil(L);
         lua_pushfstring(L, "failed to create socket: %s", strerror(errno));
         return -1;
     }
     s->fd = fd;
+    return 0;
+}
 
-    // 100% non-blocking
-    __setblocking(s->fd, 0);
+/**
+ * Accept a connection, non-blocking and close-on-exec as the sockets created
+ * by __sockobj_createsocket().
+ */
+static int
+__accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+#if defined(__linux__)
+    return accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int clientfd = accept(fd, addr, addrlen);
+    if (clientfd != -1) {
+        __setblocking(clientfd, 0);
+        fcntl(clientfd, F_SETFD, FD_CLOEXEC);
+    }
+    return clientfd;
+#endif
+}
+
+/**
+ * Check whether this call is the continuation of an operation parked on s by
+ * the scheduler, without consuming it as __sockobj_inittimeout() does.
+ */
+static int
+__sockobj_resumed(lua_State *L, struct sockobj *s)
+{
+    struct sched *sc = __sched_current(L);
+    return sc && sc->resumed && s->fd != -1 && sc->resumed->fd == s->fd;
+}
 
+/**
+ * Init the timeout of a socket operation from sock_timeout.
+ *
+ * In the continuation of an operation parked on this socket by the scheduler,
+ * restore the deadline of the parked operation instead and return 1.
+ */
+static int
+__sockobj_inittimeout(lua_State *L, struct sockobj *s, struct timeout *tm)
+{
+    struct sched *sc = __sched_current(L);
+    if (sc && sc->resumed && s->fd != -1 && sc->resumed->fd == s->fd) {
+        *tm = sc->resumed->tm;
+        sc->resumed = NULL;
+        s->waited = 1;
+        return 1;
+    }
+    __sockobj_timeout(s, tm);
+    s->waited = 0;
     return 0;
 }
 
+/**
+ * Release the result of a direct read, moving the bytes received into it to
+ * the front of the read buffer if keep is set.
+ *
+ * Returns 0, or -1 with errno set if they could not be kept.
+ */
+static int
+__sockobj_dropdirect(lua_State *L, struct sockobj *s, int keep)
+{
+    struct buffer *buf = &s->buf;
+    size_t got = s->rdirect_got;
+    int ret = 0;
+
+    if (!s->rdirect)
+        return 0;
+    if (keep && got > 0) {
+        size_t len = buffer_size(buf);
+        if (buffer_reserve(buf, got) == -1) {
+            ret = -1;
+        } else {
+            memmove(buf->pos + got, buf->pos, len);
+            memcpy(buf->pos, s->rdirect, got);
+            buf->last += got;
+        }
+    }
+    s->rdirect = NULL;
+    s->rdirect_size = 0;
+    s->rdirect_got = 0;
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, s);
+    return ret;
+}
+
 /**
  * Close associated socket and buffers.
  */
@@ -378,6 +1291,7 @@ static int
 __sockobj_close(lua_State *L, struct sockobj *s)
 {
     if (s->fd != -1) {
+        __sched_closefd(L, s->fd);
         if (close(s->fd) != 0) {
             lua_pushnil(L);
             lua_pushstring(L, strerror(errno));
@@ -385,50 +1299,119 @@ __sockobj_close(lua_State *L, struct sockobj *s)
         }
         s->fd = -1;
     }
-    if (s->buf) {
-        buffer_delete(s->buf);
-        s->buf = NULL;
+    s->connecting = 0;
+    s->deadline = -1;
+    s->rpending = 0;
+    __sockobj_dropdirect(L, s, 0);
+    buffer_free(&s->buf);
+    buffer_free(&s->wbuf);
+    if (s->pipefd[0] != -1) {
+        close(s->pipefd[0]);
+        close(s->pipefd[1]);
+        s->pipefd[0] = -1;
+        s->pipefd[1] = -1;
+        s->piped = 0;
     }
     return 0;
 }
 
+static int __sockobj_connect_k(lua_State *L);
+static int __sockobj_connected(lua_State *L, struct sockobj *s);
+
+/**
+ * Wait until the connection in progress completes.
+ */
+static int
+__sockobj_waitconnect(lua_State *L, struct sockobj *s, struct timeout *tm)
+{
+    int ret = 0;
+    char *errstr = NULL;
+
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+
+    /* Connecting in progress with timeout, wait until we have the result of
+     * the connection attempt or timeout.
+     */
+    int timeout;
+    struct pollfd pollfd;
+    pollfd.fd = s->fd;
+    pollfd.events = EVENT_WRITABLE;
+    if (poll(&pollfd, 1, 0) == 1) {
+        // completed already, or resumed by scheduler
+        timeout = 0;
+    } else {
+        timeout = __waitfd(L, s, EVENT_WRITABLE, tm, __sockobj_connect_k);
+    }
+    s->connecting = 0;
+    if (timeout == 1) {
+        errstr = ERROR_TIMEOUT;
+        goto err;
+    } else if (timeout == 0) {
+        // In case of EINPROGRESS, use getsockopt(SO_ERROR) to get the real
+        // error, when the connection attempt finished.
+        socklen_t ret_size = sizeof(ret);
+        getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &ret, &ret_size);
+        if (ret == EISCONN) {
+            errno = 0;
+        } else {
+            errno = ret;
+        }
+    } else {
+        errstr = strerror(errno);
+        goto err;
+    }
+
+    if (errno) {
+        errstr = strerror(errno);
+        goto err;
+    }
+    return 0;
+
+err:
+    assert(errstr);
+    __sockobj_close(L, s);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+
+/**
+ * Continuation of a connection parked by the scheduler.
+ */
+static int
+__sockobj_connect_k(lua_State *L)
+{
+    struct sockobj *s = getsockobj(L);
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm);
+    if (__sockobj_waitconnect(L, s, &tm) == -1)
+        return 2;
+    if (__sockobj_connected(L, s) == -1)
+        return 2;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 /**
  * Generic socket connection.
  */
 static int
 __sockobj_connect(lua_State *L, struct sockobj *s, struct sockaddr *addr, socklen_t len)
 {
-    int ret;
     char *errstr = NULL;
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm);
     assert(s->fd > 0);
 
     errno = 0;
-    ret = connect(s->fd, addr, len);
+    connect(s->fd, addr, len);
 
     if (CHECK_ERRNO(EINPROGRESS)) {
-        /* Connecting in progress with timeout, wait until we have the result of
-         * the connection attempt or timeout.
-         */
-        int timeout = __waitfd(s, EVENT_WRITABLE, &tm);
-        if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
-            goto err;
-        } else if (timeout == 0) {
-            // In case of EINPROGRESS, use getsockopt(SO_ERROR) to get the real
-            // error, when the connection attempt finished.
-            socklen_t ret_size = sizeof(ret);
-            getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &ret, &ret_size);
-            if (ret == EISCONN) {
-                errno = 0;
-            } else {
-                errno = ret;
-            }
-        } else {
-            errstr = strerror(errno);
-            goto err;
-        }
+        return __sockobj_waitconnect(L, s, &tm);
     }
 
     if (errno) {
@@ -445,41 +1428,162 @@ err:
     return -1;
 }
 
+/**
+ * Start connecting, without waiting for the connection to complete, which is
+ * left to tcpsock:connect() or socket.connect_all().
+ */
+static int
+__sockobj_connectstart(lua_State *L, struct sockobj *s, struct sockaddr *addr,
+                       socklen_t len)
+{
+    int ret;
+    do {
+        ret = connect(s->fd, addr, len);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1 && errno == EINPROGRESS) {
+        s->connecting = 1;
+    } else if (ret == -1) {
+        s->connerr = errno;
+        __sockobj_close(L, s);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(s->connerr));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Collect the result of a connection started by __sockobj_connectstart(),
+ * once the socket is writable. The socket is closed on failure, with the
+ * error kept in connerr.
+ */
+static void
+__sockobj_connectdone(lua_State *L, struct sockobj *s)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    s->connecting = 0;
+    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        err = errno;
+    if (err && err != EISCONN) {
+        s->connerr = err;
+        if (__sockobj_close(L, s) == -1)
+            lua_pop(L, 2);
+    }
+}
+
+/**
+ * Get data to send from stack at index idx, either a string or a table
+ * (array) of strings, as an iovec array pointing into the Lua strings.
+ *
+ * Small arrays use the storage given by caller (IOV_STACKSIZE entries), larger
+ * ones are allocated as userdata pushed on the stack so they are collected
+ * even if the call is interrupted. One entry is reserved before the returned
+ * array, for __sockobj_write to prepend the output buffer.
+ */
+static struct iovec *
+__sockobj_checkiov(lua_State *L, int idx, struct iovec *stack, int *iovcnt, size_t *len)
+{
+    struct iovec *iov = stack + 1;
+    int i, n;
+
+    if (lua_type(L, idx) != LUA_TTABLE) {
+        iov[0].iov_base = (void *)luaL_checklstring(L, idx, &iov[0].iov_len);
+        *iovcnt = 1;
+        *len = iov[0].iov_len;
+        return iov;
+    }
+
+    n = lua_rawlen(L, idx);
+    if (n + 1 > IOV_STACKSIZE)
+        iov = (struct iovec *)lua_newuserdata(L, (n + 1) * sizeof(struct iovec)) + 1;
+    *len = 0;
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, idx, i + 1);
+        // strings only, a number would be converted to a string that
+        // nothing references once popped
+        if (lua_type(L, -1) != LUA_TSTRING)
+            luaL_error(L, "bad data at index %d (string expected, got %s)",
+                       i + 1, luaL_typename(L, -1));
+        iov[i].iov_base = (void *)lua_tolstring(L, -1, &iov[i].iov_len);
+        *len += iov[i].iov_len;
+        // the string is still referenced by the table
+        lua_pop(L, 1);
+    }
+    *iovcnt = n;
+    return iov;
+}
+
+/**
+ * Skip the first n bytes of iovec array, updating iov and iovcnt.
+ */
+static struct iovec *
+__iov_advance(struct iovec *iov, int *iovcnt, size_t n)
+{
+    while (*iovcnt > 0 && n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        (*iovcnt)--;
+    }
+    if (n > 0 && *iovcnt > 0) {
+        iov->iov_base = (char *)iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    return iov;
+}
+
+/**
+ * Send a single message gathered from iov, to addr if given. Used for
+ * datagrams, which are never partially sent.
+ */
 static int
-__sockobj_send(lua_State *L, struct sockobj *s, const char *buf, size_t len, size_t *sent, struct timeout *tm) {
+__sockobj_sendmsg(lua_State *L, struct sockobj *s, struct iovec *iov, int iovcnt, size_t *sent, struct sockaddr *addr, socklen_t addrlen, struct timeout *tm, lua_CFunction k) {
     char *errstr;
+    struct msghdr msg;
     if (s->fd == -1) {
         errstr = ERROR_CLOSED;
         goto err;
     }
 
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = addr ? addrlen : 0;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
     while (1) {
-        int timeout = __waitfd(s, EVENT_WRITABLE, tm);
+        // Try first, the fd is non-blocking, only wait if it would block.
+        ssize_t n = sendmsg(s->fd, &msg, 0);
+        if (n >= 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            *sent = n;
+            return 0;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            break;
+        case EPIPE:
+            // EPIPE means the connection was closed.
+            errstr = ERROR_CLOSED;
+            goto err;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, tm, k);
         if (timeout == -1) {
             errstr = strerror(errno);
             goto err;
         } else if (timeout == 1) {
             errstr = ERROR_TIMEOUT;
             goto err;
-        } else {
-            int n = send(s->fd, buf, len, 0);
-            if (n < 0) {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    continue;
-                case EPIPE:
-                    // EPIPE means the connection was closed.
-                    errstr = ERROR_CLOSED;
-                    goto err;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            } else {
-                *sent = n;
-                return 0;
-            }
         }
     }
 
@@ -490,44 +1594,91 @@ err:
     return -1;
 }
 
+/**
+ * Write all data gathered from iov on a stream socket, resuming partial
+ * writes in the middle of the array. The iov array is modified, and must have
+ * one entry reserved before it (see __sockobj_checkiov).
+ *
+ * Pending data of the write buffer is written first, in the same syscalls.
+ */
 static int
-__sockobj_sendto(lua_State *L, struct sockobj *s, const char *buf, size_t len, size_t *sent, struct sockaddr *addr, socklen_t addrlen, struct timeout *tm) {
+__sockobj_write(lua_State *L, struct sockobj *s, struct iovec *iov, int iovcnt, size_t len, int flags, lua_CFunction k) {
     char *errstr;
+    size_t total_sent = 0;
+    struct msghdr msg;
     if (s->fd == -1) {
         errstr = ERROR_CLOSED;
         goto err;
     }
 
+    struct timeout tm;
+    if (__sockobj_inittimeout(L, s, &tm)) {
+        // resume a write parked by scheduler, the write buffer keeps its own
+        // progress
+        total_sent = s->wsent;
+        iov = __iov_advance(iov, &iovcnt, total_sent);
+    }
+
+    memset(&msg, 0, sizeof(msg));
     while (1) {
-        int timeout = __waitfd(s, EVENT_WRITABLE, tm);
-        if (timeout == -1) {
-            errstr = strerror(errno);
-            goto err;
-        } else if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
-            goto err;
-        } else {
-            int n = sendto(s->fd, buf, len, 0, addr, addrlen);
-            if (n < 0) {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    continue;
-                case EPIPE:
-                    // EPIPE means the connection was closed.
-                    errstr = ERROR_CLOSED;
-                    goto err;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            } else {
-                *sent = n;
-                return 0;
+        size_t pending = buffer_size(&s->wbuf);
+        if (pending == 0 && total_sent == len)
+            break;
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        if (pending > 0) {
+            msg.msg_iov = iov - 1;
+            msg.msg_iov[0].iov_base = s->wbuf.pos;
+            msg.msg_iov[0].iov_len = pending;
+            msg.msg_iovlen++;
+        }
+        if (msg.msg_iovlen > IOV_MAX)
+            msg.msg_iovlen = IOV_MAX;
+
+        ssize_t n = sendmsg(s->fd, &msg, flags);
+        if (n >= 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            if (pending > 0) {
+                size_t m = (size_t)n < pending ? (size_t)n : pending;
+                buffer_consume(&s->wbuf, m);
+                n -= m;
             }
+            total_sent += n;
+            iov = __iov_advance(iov, &iovcnt, n);
+            continue;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            break;
+        case EPIPE:
+            // EPIPE means the connection was closed.
+            errstr = ERROR_CLOSED;
+            goto err;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        s->wsent = total_sent;
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, &tm, k);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
         }
     }
 
+    assert(total_sent == len);
+    lua_pushinteger(L, total_sent);
+    return 0;
+
 err:
     assert(errstr);
     lua_pushnil(L);
@@ -535,52 +1686,186 @@ err:
     return -1;
 }
 
+/**
+ * Check whether a socket has data in SYN accepted by the peer.
+ */
 static int
-__sockobj_write(lua_State *L, struct sockobj *s, const char *buf, size_t len) {
-    char *errstr;
-    size_t total_sent = 0;
+__sockobj_synacked(struct sockobj *s)
+{
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(s->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+        return (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0;
+#else
+    (void)s;
+#endif
+    return 0;
+}
+
+/**
+ * Called once a connection is established: count whether data sent in SYN
+ * was accepted, and send fast open data which could not go in SYN.
+ *
+ * Returns 0 on success, -1 on failure (with nil and error message pushed).
+ */
+static int
+__sockobj_connected(lua_State *L, struct sockobj *s)
+{
+    struct iovec stack[1];
+
+    if (s->fastopen) {
+        s->fastopen = 0;
+        if (__sockobj_synacked(s))
+            stats.tfo_syn_acked++;
+    }
+    if (buffer_size(&s->wbuf) > 0) {
+        if (__sockobj_write(L, s, stack + 1, 0, 0, 0, __sockobj_connect_k) == -1)
+            return -1;
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+/**
+ * Connect with TCP Fast Open: data is sent in the SYN if a cookie of the
+ * server is cached, otherwise the SYN asks for one and data is sent after
+ * the handshake.
+ */
+static int
+__sockobj_fastopen(lua_State *L, struct sockobj *s, struct sockaddr *addr,
+                   socklen_t addrlen, const char *data, size_t len)
+{
+    ssize_t n = -1;
+    int inprogress = 0;
+
+    stats.tfo_connects++;
+#if defined(MSG_FASTOPEN)
+    do {
+        n = sendto(s->fd, data, len, MSG_FASTOPEN, addr, addrlen);
+    } while (n == -1 && errno == EINTR);
+    if (n >= 0) {
+        stats.tfo_syn_data++;
+        s->fastopen = 1;
+        inprogress = 1;
+    } else if (errno == EINPROGRESS) {
+        inprogress = 1;
+    } else if (errno != EOPNOTSUPP) {
+        char *errstr = strerror(errno);
+        __sockobj_close(L, s);
+        lua_pushnil(L);
+        lua_pushstring(L, errstr);
+        return -1;
+    }
+#endif
+    if (n < 0)
+        n = 0;
+    if ((size_t)n < len && buffer_append(&s->wbuf, data + n, len - n) == -1) {
+        char *errstr = strerror(errno);
+        __sockobj_close(L, s);
+        lua_pushnil(L);
+        lua_pushstring(L, errstr);
+        return -1;
+    }
+    if (inprogress) {
+        struct timeout tm;
+        __sockobj_timeout(s, &tm);
+        return __sockobj_waitconnect(L, s, &tm);
+    }
+    // fast open not supported, plain connect
+    return __sockobj_connect(L, s, addr, addrlen);
+}
+
+static int
+__sockobj_recv(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, size_t *received, struct timeout *tm, lua_CFunction k)
+{
+    char *errstr = NULL;
+
     if (s->fd == -1) {
         errstr = ERROR_CLOSED;
         goto err;
     }
 
-    struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
     while (1) {
-        int timeout = __waitfd(s, EVENT_WRITABLE, &tm);
+        int bytes_read = recv(s->fd, buf, buffersize, 0);
+        if (bytes_read > 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            *received = bytes_read;
+            return 0;
+        } else if (bytes_read == 0) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            break;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        int timeout = __waitfd(L, s, EVENT_READABLE, tm, k);
         if (timeout == -1) {
             errstr = strerror(errno);
             goto err;
         } else if (timeout == 1) {
             errstr = ERROR_TIMEOUT;
             goto err;
-        } else {
-            int n = send(s->fd, buf + total_sent, len - total_sent, 0);
-            if (n < 0) {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    continue;
-                case EPIPE:
-                    // EPIPE means the connection was closed.
-                    errstr = ERROR_CLOSED;
-                    goto err;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            } else {
-                total_sent += n;
-                if (len - total_sent <= 0) {
-                    break;
-                }
-            }
         }
     }
 
-    assert(total_sent == len);
-    lua_pushinteger(L, total_sent);
-    return 0;
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return -1;
+}
+
+static int
+__sockobj_recvfrom(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, size_t *received, struct sockaddr *addr, socklen_t *addrlen, struct timeout *tm, lua_CFunction k)
+{
+    char *errstr = NULL;
+
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+
+    while (1) {
+        int bytes_read = recvfrom(s->fd, buf, buffersize, 0, addr, addrlen);
+        if (bytes_read > 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            *received = bytes_read;
+            return 0;
+        } else if (bytes_read == 0) {
+            errstr = ERROR_CLOSED;
+            goto err;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            break;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        int timeout = __waitfd(L, s, EVENT_READABLE, tm, k);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
+    }
 
 err:
     assert(errstr);
@@ -589,8 +1874,66 @@ err:
     return -1;
 }
 
+/**
+ * Get the receive arena of the socket, at least size bytes.
+ *
+ * Datagram sockets reuse their read buffer, so receiving does not allocate
+ * memory once it is large enough.
+ */
+static char *
+__sockobj_arena(struct sockobj *s, size_t size)
+{
+    if (buffer_reserve(&s->buf, size) == -1)
+        return NULL;
+    return s->buf.last;
+}
+
+/**
+ * Receive up to n messages, with recvmmsg() if available.
+ *
+ * Returns the number of messages received, or -1 on error.
+ */
+static int
+__recvmmsg(int fd, mmsghdr_t *msgs, unsigned int n)
+{
+#if defined(__linux__)
+    return recvmmsg(fd, msgs, n, 0, NULL);
+#else
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        ssize_t len = recvmsg(fd, &msgs[i].msg_hdr, 0);
+        if (len == -1)
+            return i > 0 ? (int)i : -1;
+        msgs[i].msg_len = len;
+    }
+    return i;
+#endif
+}
+
+/**
+ * Send up to n messages, with sendmmsg() if available.
+ *
+ * Returns the number of messages sent, or -1 on error.
+ */
+static int
+__sendmmsg(int fd, mmsghdr_t *msgs, unsigned int n)
+{
+#if defined(__linux__)
+    return sendmmsg(fd, msgs, n, 0);
+#else
+    unsigned int i;
+    for (i = 0; i < n; i++) {
+        ssize_t len = sendmsg(fd, &msgs[i].msg_hdr, 0);
+        if (len == -1)
+            return i > 0 ? (int)i : -1;
+        msgs[i].msg_len = len;
+    }
+    return i;
+#endif
+}
+
 static int
-__sockobj_recv(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, size_t *received, struct timeout *tm)
+__sockobj_sendmany(lua_State *L, struct sockobj *s, mmsghdr_t *msgs, unsigned int n, int *sent, struct timeout *tm, lua_CFunction k)
 {
     char *errstr = NULL;
 
@@ -600,32 +1943,31 @@ __sockobj_recv(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, si
     }
 
     while (1) {
-        int timeout = __waitfd(s, EVENT_READABLE, tm);
+        int nmsgs = __sendmmsg(s->fd, msgs, n);
+        if (nmsgs >= 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            *sent = nmsgs;
+            return 0;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            break;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, tm, k);
         if (timeout == -1) {
             errstr = strerror(errno);
             goto err;
         } else if (timeout == 1) {
             errstr = ERROR_TIMEOUT;
             goto err;
-        } else {
-            int bytes_read = recv(s->fd, buf, buffersize, 0);
-            if (bytes_read > 0) {
-                *received = bytes_read;
-                return 0;
-            } else if (bytes_read == 0) {
-                errstr = ERROR_CLOSED;
-                goto err;
-            } else {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    // do nothing, continue
-                    continue;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            }
         }
     }
 
@@ -637,7 +1979,7 @@ err:
 }
 
 static int
-__sockobj_recvfrom(lua_State *L, struct sockobj *s, char *buf, size_t buffersize, size_t *received, struct sockaddr *addr, socklen_t *addrlen, struct timeout *tm)
+__sockobj_recvmany(lua_State *L, struct sockobj *s, mmsghdr_t *msgs, unsigned int n, int *received, struct timeout *tm, lua_CFunction k)
 {
     char *errstr = NULL;
 
@@ -647,32 +1989,31 @@ __sockobj_recvfrom(lua_State *L, struct sockobj *s, char *buf, size_t buffersize
     }
 
     while (1) {
-        int timeout = __waitfd(s, EVENT_READABLE, tm);
+        int nmsgs = __recvmmsg(s->fd, msgs, n);
+        if (nmsgs > 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            *received = nmsgs;
+            return 0;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            break;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        int timeout = __waitfd(L, s, EVENT_READABLE, tm, k);
         if (timeout == -1) {
             errstr = strerror(errno);
             goto err;
         } else if (timeout == 1) {
             errstr = ERROR_TIMEOUT;
             goto err;
-        } else {
-            int bytes_read = recvfrom(s->fd, buf, buffersize, 0, addr, addrlen);
-            if (bytes_read > 0) {
-                *received = bytes_read;
-                return 0;
-            } else if (bytes_read == 0) {
-                errstr = ERROR_CLOSED;
-                goto err;
-            } else {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    // do nothing, continue
-                    continue;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            }
         }
     }
 
@@ -682,6 +2023,7 @@ err:
     lua_pushstring(L, errstr);
     return -1;
 }
+
 /**
  * tcpsock, err = socket.tcp()
  */
@@ -806,233 +2148,2129 @@ socket_select(lua_State * L)
     }
 }
 
-/*** sock_* methods are common to tcpsocket or udpsocket ***/
-
 /**
- * fd = sockobj:fileno()
- *
- * Return the integer file descriptor of the socket.
+ * Give the scheduler its own poller in a forked child: the parent's epoll or
+ * io_uring instance is shared across fork().
  */
-static int
-sockobj_fileno(lua_State * L)
+static void
+__sched_forked(lua_State *L)
 {
-    struct sockobj *s = getsockobj(L);
-    lua_pushnumber(L, s->fd);
-    return 1;
+    struct sched *sc = __sched_get(L);
+    int fd;
+    if (!sc)
+        return;
+    poller_delete(sc->poller);
+    sc->poller = poller_create_ring();
+    if (!sc->poller) {
+        fprintf(stderr, "failed to create poller: %s\n", strerror(errno));
+        _exit(1);
+    }
+    for (fd = 0; fd < sc->nslots; fd++) {
+        sc->slots[fd].events = 0;
+        __sched_register(sc, fd);
+    }
 }
 
 /**
- * ok, err = sockobj:close()
+ * ok, err = socket.fork_workers(n, fn[, opts])
  *
- * Close the socket.
+ * Fork n worker processes, each calling fn(index, cpu), then wait for all of
+ * them to exit. With opts.pin, worker i is pinned to CPU (i - 1) % ncpus,
+ * which is given as cpu either way, e.g. for bind option incoming_cpu.
+ *
+ * Each worker is meant to bind its own listener with the reuseport option, so
+ * the kernel spreads connections between their accept queues.
  */
 static int
-sockobj_close(lua_State * L)
+socket_fork_workers(lua_State * L)
 {
-    struct sockobj *s = getsockobj(L);
+    int n = luaL_checkinteger(L, 1);
+    int pin = 0, i, started, status;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t *pids;
+    char *errstr = NULL;
+    int failed = 0;
 
-    if (__sockobj_close(L, s) == -1)
-        return 2;
+    luaL_argcheck(L, n > 0, 1, "number of workers must be positive");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "pin");
+        pin = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+    if (ncpus < 1)
+        ncpus = 1;
+    pids = (pid_t *)lua_newuserdata(L, n * sizeof(pid_t));
+
+    // don't let buffered output be written by every worker
+    fflush(NULL);
+    for (started = 0; started < n; started++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            errstr = strerror(errno);
+            break;
+        }
+        if (pid == 0) {
+            int cpu = started % ncpus;
+#if defined(__linux__)
+            if (pin) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                if (sched_setaffinity(0, sizeof(set), &set) == -1)
+                    fprintf(stderr, "worker %d: failed to pin to CPU %d: %s\n",
+                            started + 1, cpu, strerror(errno));
+            }
+#else
+            (void)pin;
+#endif
+            resolver_forked();
+            __sched_forked(L);
+            lua_pushvalue(L, 2);
+            lua_pushinteger(L, started + 1);
+            lua_pushinteger(L, cpu);
+            status = lua_pcall(L, 2, 0, 0);
+            if (status != LUA_OK)
+                fprintf(stderr, "worker %d: %s\n", started + 1, lua_tostring(L, -1));
+            fflush(NULL);
+            _exit(status == LUA_OK ? 0 : 1);
+        }
+        pids[started] = pid;
+    }
 
-    lua_pushboolean(L, 1);
-    return 1;
-}
+    for (i = 0; i < started; i++) {
+        while (waitpid(pids[i], &status, 0) == -1) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+        if (!failed && !(status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0))
+            failed = i + 1;
+    }
 
-static int
-sockobj_tostring(lua_State * L)
-{
-    struct sockobj *s = getsockobj(L);
-    assert(lua_getmetatable(L, -1));
-    luaL_getmetatable(L, TCPSOCK_TYPENAME);
-    if (lua_rawequal(L, -1, -2)) {
-        lua_pop(L, 2);
-        lua_pushfstring(L, "<tcpsock: %d>", s->fd);
-    } else {
-        lua_pop(L, 2);
-        lua_pushfstring(L, "<udpsock: %d>", s->fd);
+    if (errstr) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "fork failed: %s", errstr);
+        return 2;
+    }
+    if (failed) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "worker %d failed", failed);
+        return 2;
     }
+    lua_pushboolean(L, 1);
     return 1;
 }
 
 /**
- * sockobj:settimeout(timeout)
+ * results, nconnected = socket.connect_all(socks[, timeout=-1[, mode="all"]])
  *
- * Set the timeout in seconds for subsequent socket operations.
- * A negative timeout indicates that timeout is disabled, which is default.
- */
-static int
-sockobj_settimeout(lua_State * L)
-{
-    struct sockobj *s = getsockobj(L);
-    double timeout = (double)luaL_checknumber(L, 2);
-    s->sock_timeout = timeout;
-    return 0;
-}
-
-/*
- * timeout = sockobj:gettimeout()
+ * Wait for connections started by tcpsock:connect_start() on the array socks,
+ * until all of them are done (mode "all") or one of them is connected (mode
+ * "any"), or timeout expires. results[i] is true if socks[i] is connected, an
+ * error message if it failed (the socket is closed), or false if still in
+ * progress (mode "any"). Connections still in progress on timeout are closed
+ * with socket.ERROR_TIMEOUT. nconnected counts the connections completed
+ * during this call, sockets already connected are not waited for.
  *
- * Returns the timeout in seconds associated with socket.
- * A negative timeout indicates that timeout is disabled, which is default.
+ * A managed coroutine is parked on all pending sockets at once and resumed as
+ * soon as one of them completes, other callers wait for all of them in a
+ * single poll loop.
  */
 static int
-sockobj_gettimeout(lua_State * L)
+socket_connect_all(lua_State * L)
 {
-    struct sockobj *s = getsockobj(L);
+    static const char *const modes[] = {"all", "any", NULL};
+    double timeout = luaL_optnumber(L, 2, -1);
+    int any = luaL_checkoption(L, 3, "all", modes);
+    struct sched *sc = __sched_current(L);
+    struct sockobj **socks, **pending;
+    struct pollfd *fds;
+    struct timeout tm;
+    int i, n, npending, nconnected, ret, resumed = 0;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 3);
+    n = lua_rawlen(L, 1);
+    socks = (struct sockobj **)lua_newuserdata(L, (2 * n + 1) * sizeof(*socks));
+    pending = socks + n;
+    fds = (struct pollfd *)lua_newuserdata(L, (n + 1) * sizeof(*fds));
+
+    timeout_init(&tm, timeout);
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        socks[i] = (struct sockobj *)luaL_testudata(L, -1, TCPSOCK_TYPENAME);
+        if (!socks[i])
+            return luaL_error(L, "bad argument #1 to 'connect_all' "
+                              "(tcpsock expected at index %d)", i + 1);
+        lua_pop(L, 1);
+        if (sc && sc->resumed && socks[i]->fd != -1 && sc->resumed->fd == socks[i]->fd) {
+            // resumed, keep the deadline of first call
+            tm = sc->resumed->tm;
+            sc->resumed = NULL;
+            resumed = 1;
+        }
+    }
+    if (!resumed) {
+        for (i = 0; i < n; i++)
+            socks[i]->connwaited = socks[i]->connecting;
+    }
+
+    for (;;) {
+        npending = nconnected = 0;
+        for (i = 0; i < n; i++) {
+            if (socks[i]->connecting) {
+                fds[npending].fd = socks[i]->fd;
+                fds[npending].events = POLLOUT;
+                fds[npending].revents = 0;
+                pending[npending++] = socks[i];
+            } else if (socks[i]->connwaited && socks[i]->fd != -1) {
+                nconnected++;
+            }
+        }
+        if (npending == 0 || (any && nconnected > 0))
+            break;
+
+        double left = timeout_left(&tm);
+        if (left == 0.0)
+            break;
+        do {
+            ret = __poll(fds, npending, sc ? 0 : left);
+        } while (ret == -1 && errno == EINTR);
+        if (ret == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+        for (i = 0; i < npending; i++) {
+            if (fds[i].revents)
+                __sockobj_connectdone(L, pending[i]);
+        }
+        if (ret == 0 && sc) {
+            lua_settop(L, 3);
+            // woken by the first one to complete
+            if (__sched_parkmany(L, sc, fds, npending, &tm,
+                                 socket_connect_all) == -1) {
+                lua_pushnil(L);
+                lua_pushstring(L, strerror(errno));
+                return 2;
+            }
+        }
+    }
+
+    lua_createtable(L, n, 0);
+    for (i = 0; i < n; i++) {
+        struct sockobj *s = socks[i];
+        if (s->connecting && (!any || nconnected == 0)) {
+            // timed out
+            s->connerr = -1;
+            if (__sockobj_close(L, s) == -1)
+                lua_pop(L, 2);
+        }
+        if (s->connecting)
+            lua_pushboolean(L, 0);
+        else if (s->fd != -1)
+            lua_pushboolean(L, 1);
+        else if (s->connerr == -1)
+            lua_pushstring(L, ERROR_TIMEOUT);
+        else if (s->connerr)
+            lua_pushstring(L, strerror(s->connerr));
+        else
+            lua_pushstring(L, ERROR_CLOSED);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushinteger(L, nconnected);
+    return 2;
+}
+
+/**
+ * deadline = socket.deadline(seconds)
+ *
+ * Create a deadline, the given number of seconds from now. It can be attached
+ * to sockets with sockobj:setdeadline(), or given to single calls of
+ * tcpsock:connect(), tcpsock:read(), tcpsock:write() and tcpsock:readuntil(),
+ * to share a single time budget between many operations, on several sockets.
+ */
+static int
+socket_deadline(lua_State * L)
+{
+    double seconds = luaL_checknumber(L, 1);
+    double *d = (double *)lua_newuserdata(L, sizeof(*d));
+    *d = timeout_gettime() + seconds;
+    luaL_setmetatable(L, DEADLINE_TYPENAME);
+    return 1;
+}
+
+/**
+ * seconds = deadline:left()
+ *
+ * Time left before the deadline, 0 once passed.
+ */
+static int
+deadlineobj_left(lua_State * L)
+{
+    double *d = (double *)luaL_checkudata(L, 1, DEADLINE_TYPENAME);
+    double left = *d - timeout_gettime();
+    lua_pushnumber(L, left > 0 ? left : 0);
+    return 1;
+}
+
+/**
+ * expired = deadline:expired()
+ */
+static int
+deadlineobj_expired(lua_State * L)
+{
+    double *d = (double *)luaL_checkudata(L, 1, DEADLINE_TYPENAME);
+    lua_pushboolean(L, *d <= timeout_gettime());
+    return 1;
+}
+
+/**
+ * addr, err = socket.address(host, port)
+ * addr, err = socket.address("/path/to/unix-domain.sock")
+ *
+ * Resolve an address once, the address object can be given to connect, bind,
+ * sendto or sendmany instead of host and port.
+ */
+static int
+socket_address(lua_State * L)
+{
+    sockaddr_t addr;
+    socklen_t addrlen;
+    const char *host = luaL_checkstring(L, 1);
+
+    memset(&addr, 0, sizeof(addr));
+    if (lua_isnoneornil(L, 2)) {
+        addr.un.sun_family = AF_UNIX;
+        strncpy(addr.un.sun_path, host, sizeof(addr.un.sun_path) - 1);
+        addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(addr.un.sun_path) + 1;
+    } else {
+        lua_Integer port = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, port >= 0 && port <= 65535, 2, "port out of range");
+        if (__sockobj_setipaddr(L, host, SAS2SA(&addr), sizeof(addr.in), AF_INET,
+                                -1, socket_address) != 0)
+            return 2;
+        addr.in.sin_family = AF_INET;
+        addr.in.sin_port = htons(port);
+        addrlen = sizeof(addr.in);
+    }
+    __addrobj_push(L, SAS2SA(&addr), addrlen);
+    return 1;
+}
+
+/**
+ * poller, err = socket.poller()
+ *
+ * Create a poller object. Sockets are registered once with poller:add() and
+ * poller:wait() returns only the ones which are ready.
+ */
+static int
+socket_poller(lua_State * L)
+{
+    struct pollerobj *p =
+        (struct pollerobj *)lua_newuserdata(L, sizeof(struct pollerobj));
+    p->poller = NULL;
+    p->events = NULL;
+    p->nevents = 0;
+    luaL_setmetatable(L, POLLER_TYPENAME);
+
+    p->poller = poller_create();
+    if (!p->poller) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to create poller: %s", strerror(errno));
+        return 2;
+    }
+
+    // sockets registered, keyed by their sockobj address
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+    return 1;
+}
+
+/**
+ * Get the scheduler of this Lua state, create it if necessary.
+ */
+static struct sched *
+__sched_checkget(lua_State *L)
+{
+    struct sched *sc = __sched_get(L);
+    if (sc)
+        return sc;
+
+    sc = (struct sched *)lua_newuserdata(L, sizeof(struct sched));
+    memset(sc, 0, sizeof(*sc));
+    luaL_setmetatable(L, SCHED_TYPENAME);
+    sc->poller = poller_create_ring();
+    sc->events = malloc(SCHED_MAXEVENTS * sizeof(*sc->events));
+    sc->wheel = wheel_create(timeout_gettime());
+    if (!sc->poller || !sc->events || !sc->wheel) {
+        luaL_error(L, "failed to create scheduler: %s", strerror(errno));
+    }
+
+    // managed coroutines, anchored until they finish
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &sched_key);
+    return sc;
+}
+
+static int
+sched_gc(lua_State *L)
+{
+    struct sched *sc = (struct sched *)lua_touserdata(L, 1);
+    struct wheel_timer *t;
+    int i;
+    // waiters parked on a fd are freed with the slots below
+    while (sc->wheel && (t = wheel_any(sc->wheel))) {
+        struct waiter *w = t->ud;
+        wheel_del(sc->wheel, t);
+        if (w->fd < 0) {
+            if (w->owner)
+                w->owner->w = NULL;
+            free(w);
+        }
+    }
+    for (i = 0; i < sc->nslots; i++) {
+        free(sc->slots[i].rd);
+        free(sc->slots[i].wr);
+    }
+    for (i = 0; i < sc->nrunq; i++) {
+        if (sc->runq[i]->owner)
+            sc->runq[i]->owner->w = NULL;
+        free(sc->runq[i]);
+    }
+    free(sc->slots);
+    if (sc->wheel)
+        wheel_delete(sc->wheel);
+    free(sc->runq);
+    free(sc->events);
+    if (sc->poller)
+        poller_delete(sc->poller);
+    return 0;
+}
+
+/**
+ * Forget a finished coroutine.
+ */
+static void
+__sched_release(lua_State *L, struct sched *sc, lua_State *co)
+{
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &sched_key);
+    lua_getuservalue(L, -1);
+    lua_pushnil(L);
+    lua_rawsetp(L, -2, co);
+    lua_pop(L, 2);
+    sc->nthreads--;
+}
+
+/**
+ * Resume a runnable waiter.
+ *
+ * Returns 0, or -1 with error message pushed on the stack if the coroutine
+ * raised an error.
+ */
+static int
+__sched_resume(lua_State *L, struct sched *sc, struct waiter *w)
+{
+    lua_State *co = w->co;
+    int status, nres;
+
+    sc->current = co;
+    sc->resumed = w;
+    sc->parked = 0;
+    status = __resume(co, L, w->nargs, &nres);
+    sc->current = NULL;
+    sc->resumed = NULL;
+    if (w->owner)
+        w->owner->w = NULL;
+    free(w);
+
+    if (status == LUA_YIELD) {
+        lua_pop(co, nres);
+        if (!sc->parked) {
+            // yielded by coroutine.yield(), run it again later
+            w = __sched_newwaiter(co, 0);
+            if (!w || __sched_enqueue(sc, w) == -1)
+                return luaL_error(L, "out of memory");
+        }
+        return 0;
+    } else if (status == LUA_OK) {
+        __sched_release(L, sc, co);
+        return 0;
+    } else {
+        lua_xmove(co, L, 1);
+        __sched_release(L, sc, co);
+        return -1;
+    }
+}
+
+/**
+ * Turn the function at index 1 and the values above it into a managed
+ * coroutine, left alone on the stack. Returns the waiter to start it with.
+ */
+static struct waiter *
+__sched_spawn(lua_State *L, struct sched *sc)
+{
+    int n = lua_gettop(L);
+    struct waiter *w;
+    lua_State *co;
+
+    co = lua_newthread(L);
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &sched_key);
+    lua_getuservalue(L, -1);
+    lua_pushvalue(L, n + 1);
+    lua_rawsetp(L, -2, co);
+    lua_pop(L, 2);
+
+    w = __sched_newwaiter(co, n - 1);
+    if (!w)
+        luaL_error(L, "out of memory");
+    sc->nthreads++;
+
+    // move fn and its arguments to the coroutine
+    lua_insert(L, 1);
+    lua_xmove(L, co, n);
+    return w;
+}
+
+/**
+ * co = socket.spawn(fn, ...)
+ *
+ * Create a coroutine managed by the scheduler, which runs fn(...) once
+ * socket.run() is called. Socket methods called from managed coroutines
+ * yield to the scheduler instead of blocking.
+ */
+static int
+socket_spawn(lua_State *L)
+{
+    struct sched *sc;
+    struct waiter *w;
+
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    sc = __sched_checkget(L);
+    w = __sched_spawn(L, sc);
+    if (__sched_enqueue(sc, w) == -1) {
+        __sched_release(L, sc, w->co);
+        free(w);
+        return luaL_error(L, "out of memory");
+    }
+    return 1;
+}
+
+/**
+ * timer = socket.timer(after, fn, ...)
+ *
+ * Like socket.spawn(), but fn(...) starts after the given number of seconds,
+ * when socket.run() is running. Pending timers are kept in a timer wheel, so
+ * that adding and cancelling them is cheap however many there are.
+ */
+static int
+socket_timer(lua_State *L)
+{
+    double after = luaL_checknumber(L, 1);
+    struct sched *sc;
+    struct timerobj *t;
+    struct waiter *w;
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    sc = __sched_checkget(L);
+    lua_remove(L, 1);
+    w = __sched_spawn(L, sc);
+    wheel_add(sc->wheel, &w->timer, timeout_gettime() + (after > 0 ? after : 0));
+
+    t = (struct timerobj *)lua_newuserdata(L, sizeof(*t));
+    luaL_setmetatable(L, TIMER_TYPENAME);
+    t->w = w;
+    w->owner = t;
+    return 1;
+}
+
+/**
+ * ok = timer:cancel()
+ *
+ * Cancel a timer which has not fired yet. Returns true if it was cancelled,
+ * false if fn has been started already.
+ */
+static int
+timerobj_cancel(lua_State *L)
+{
+    struct timerobj *t = (struct timerobj *)luaL_checkudata(L, 1, TIMER_TYPENAME);
+    struct waiter *w = t->w;
+    struct sched *sc = __sched_get(L);
+
+    if (!sc || !w || !wheel_pending(&w->timer)) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    wheel_del(sc->wheel, &w->timer);
+    __sched_release(L, sc, w->co);
+    free(w);
+    t->w = NULL;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+timerobj_gc(lua_State *L)
+{
+    struct timerobj *t = (struct timerobj *)lua_touserdata(L, 1);
+    // the timer still fires, it just cannot be cancelled anymore
+    if (t->w)
+        t->w->owner = NULL;
+    return 0;
+}
+
+static int
+__socket_sleep_k(lua_State *L)
+{
+    (void)L;
+    return 0;
+}
+
+/**
+ * socket.sleep(seconds)
+ *
+ * Suspend the calling managed coroutine for the given number of seconds,
+ * letting others run; socket.sleep(0) just lets them run. Outside of managed
+ * coroutines, blocks the whole Lua state.
+ */
+static int
+socket_sleep(lua_State *L)
+{
+    double seconds = luaL_checknumber(L, 1);
+    struct sched *sc = __sched_current(L);
+    struct timeout tm;
+    struct timespec ts;
+
+    if (sc) {
+        lua_settop(L, 0);
+        if (seconds <= 0) {
+            // rescheduled by socket.run() like after coroutine.yield()
+            return __yieldk(L, __socket_sleep_k);
+        }
+        timeout_init(&tm, seconds);
+        if (__sched_park(L, sc, -1, EVENT_NONE, &tm, __socket_sleep_k) == -1)
+            return luaL_error(L, "%s", strerror(errno));
+    }
+    if (seconds <= 0)
+        return 0;
+    timeout_timespec(seconds, &ts);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+    return 0;
+}
+
+/**
+ * Resume waiters of fd according to ready events.
+ */
+static void
+__sched_ready(struct sched *sc, int fd, int events)
+{
+    struct fdslot *slot = &sc->slots[fd];
+    if ((events & POLLER_READ) && slot->rd)
+        __sched_wake(sc, slot->rd);
+    if ((events & POLLER_WRITE) && slot->wr)
+        __sched_wake(sc, slot->wr);
+    // stop watching events nobody waits for
+    __sched_register(sc, fd);
+}
+
+/**
+ * ok, err = socket.run()
+ *
+ * Run managed coroutines until all of them have finished.
+ *
+ * If a coroutine raises an error, it returns nil with the error message.
+ * Other coroutines are left as is and socket.run() may be called again.
+ */
+static int
+socket_run(lua_State *L)
+{
+    struct sched *sc = __sched_checkget(L);
+    int i, n;
+
+    if (sc->running) {
+        return luaL_error(L, "scheduler is already running");
+    }
+    sc->running = 1;
+
+    while (sc->nthreads > 0) {
+        // resume coroutines made runnable so far
+        n = sc->nrunq;
+        for (i = 0; i < n; i++) {
+            if (__sched_resume(L, sc, sc->runq[i]) == -1) {
+                memmove(sc->runq, sc->runq + i + 1, (sc->nrunq - i - 1) * sizeof(*sc->runq));
+                sc->nrunq -= i + 1;
+                sc->running = 0;
+                lua_pushnil(L);
+                lua_insert(L, -2);
+                return 2;
+            }
+        }
+        memmove(sc->runq, sc->runq + n, (sc->nrunq - n) * sizeof(*sc->runq));
+        sc->nrunq -= n;
+
+        if (sc->nthreads == 0)
+            break;
+
+        double timeout = -1;
+        if (sc->nrunq > 0) {
+            timeout = 0;
+        } else {
+            timeout = wheel_next(sc->wheel, timeout_gettime());
+        }
+
+        n = poller_wait(sc->poller, sc->events, SCHED_MAXEVENTS, timeout);
+        if (n < 0) {
+            sc->running = 0;
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+        for (i = 0; i < n; i++) {
+            __sched_ready(sc, (int)(intptr_t)sc->events[i].ud, sc->events[i].events);
+        }
+
+        // wake waiters whose deadline expired
+        double now = timeout_gettime();
+        struct wheel_timer *t;
+        while ((t = wheel_expired(sc->wheel, now)) != NULL) {
+            __sched_wake(sc, t->ud);
+        }
+    }
+
+    sc->running = 0;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * stats = socket.stats()
+ *
+ * Returns a table of module statistics:
+ *  - io_fast: I/O calls which succeeded without waiting
+ *  - io_waits: I/O calls which would block, and had to wait for the socket
+ *  - poller: mechanism used by the scheduler ("epoll", "io_uring" or "poll")
+ *  - dns_hits, dns_misses: host names found in resolver cache, or resolved
+ *  - dns_entries: host names in resolver cache
+ *  - pool_hits, pool_misses: connects which reused a pooled connection, or
+ *    opened a new one
+ *  - tfo_connects: connects with fast open data, tfo_syn_data: the ones
+ *    which sent it in SYN, tfo_syn_acked: the ones the server accepted it
+ *  - tfo_accepts: accepted connections which got data in SYN
+ */
+static int
+socket_stats(lua_State *L)
+{
+    struct sched *sc = __sched_checkget(L);
+    struct resolver_stat rs;
+    resolver_stats(&rs);
+    lua_newtable(L);
+    lua_pushnumber(L, rs.hits);
+    lua_setfield(L, -2, "dns_hits");
+    lua_pushnumber(L, rs.misses);
+    lua_setfield(L, -2, "dns_misses");
+    lua_pushnumber(L, rs.entries);
+    lua_setfield(L, -2, "dns_entries");
+    lua_pushnumber(L, stats.pool_hits);
+    lua_setfield(L, -2, "pool_hits");
+    lua_pushnumber(L, stats.pool_misses);
+    lua_setfield(L, -2, "pool_misses");
+    lua_pushnumber(L, stats.tfo_connects);
+    lua_setfield(L, -2, "tfo_connects");
+    lua_pushnumber(L, stats.tfo_syn_data);
+    lua_setfield(L, -2, "tfo_syn_data");
+    lua_pushnumber(L, stats.tfo_syn_acked);
+    lua_setfield(L, -2, "tfo_syn_acked");
+    lua_pushnumber(L, stats.tfo_accepts);
+    lua_setfield(L, -2, "tfo_accepts");
+    lua_pushstring(L, poller_backend(sc->poller));
+    lua_setfield(L, -2, "poller");
+    lua_pushnumber(L, stats.io_fast);
+    lua_setfield(L, -2, "io_fast");
+    lua_pushnumber(L, stats.io_waits);
+    lua_setfield(L, -2, "io_waits");
+    return 1;
+}
+
+/**
+ * socket.setresolver{ttl = 30, negative_ttl = 5, threads = 2}
+ *
+ * Configure host name resolution: how long resolved names (ttl) and failed
+ * lookups (negative_ttl) are cached, in seconds, and the maximum number of
+ * worker threads resolving names for managed coroutines. Fields left out keep
+ * their current value. The cache is flushed.
+ */
+static int
+socket_setresolver(lua_State *L)
+{
+    double ttl, negttl;
+    int threads;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "ttl");
+    ttl = luaL_optnumber(L, -1, -1);
+    lua_getfield(L, 1, "negative_ttl");
+    negttl = luaL_optnumber(L, -1, -1);
+    lua_getfield(L, 1, "threads");
+    threads = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 3);
+    if (threads < 0)
+        return luaL_argerror(L, 1, "threads must be positive");
+    resolver_config(ttl, negttl, threads);
+    return 0;
+}
+
+/**
+ * stats = socket.bufstats()
+ *
+ * Returns occupancy of the buffer pool: an array of size classes, as tables
+ * with fields size, used (storages held by sockets) and cached (free storages
+ * kept by pool), and the fields:
+ *  - large: number of storages too large for the pool
+ *  - used_bytes, cached_bytes: total bytes held by sockets, and kept by pool
+ */
+static int
+socket_bufstats(lua_State *L)
+{
+    struct buffer_poolstat stats[BUFFER_NCLASSES + 1];
+    int i, n = buffer_poolstats(stats, BUFFER_NCLASSES + 1);
+    size_t used_bytes = 0, cached_bytes = 0;
+
+    lua_createtable(L, n - 1, 3);
+    for (i = 0; i < n; i++) {
+        if (stats[i].size == 0) {
+            lua_pushnumber(L, stats[i].used);
+            lua_setfield(L, -2, "large");
+            continue;
+        }
+        used_bytes += stats[i].size * stats[i].used;
+        cached_bytes += stats[i].size * stats[i].cached;
+        lua_createtable(L, 0, 3);
+        lua_pushnumber(L, stats[i].size);
+        lua_setfield(L, -2, "size");
+        lua_pushnumber(L, stats[i].used);
+        lua_setfield(L, -2, "used");
+        lua_pushnumber(L, stats[i].cached);
+        lua_setfield(L, -2, "cached");
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushnumber(L, used_bytes);
+    lua_setfield(L, -2, "used_bytes");
+    lua_pushnumber(L, cached_bytes);
+    lua_setfield(L, -2, "cached_bytes");
+    return 1;
+}
+
+/*** sock_* methods are common to tcpsocket or udpsocket ***/
+
+/**
+ * fd = sockobj:fileno()
+ *
+ * Return the integer file descriptor of the socket.
+ */
+static int
+sockobj_fileno(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    lua_pushnumber(L, s->fd);
+    return 1;
+}
+
+/**
+ * ok, err = sockobj:close()
+ *
+ * Close the socket.
+ */
+static int
+sockobj_close(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+
+    if (__sockobj_close(L, s) == -1)
+        return 2;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+sockobj_tostring(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    assert(lua_getmetatable(L, -1));
+    luaL_getmetatable(L, TCPSOCK_TYPENAME);
+    if (lua_rawequal(L, -1, -2)) {
+        lua_pop(L, 2);
+        lua_pushfstring(L, "<tcpsock: %d>", s->fd);
+    } else {
+        lua_pop(L, 2);
+        lua_pushfstring(L, "<udpsock: %d>", s->fd);
+    }
+    return 1;
+}
+
+/**
+ * sockobj:settimeout(timeout)
+ *
+ * Set the timeout in seconds for subsequent socket operations.
+ * A negative timeout indicates that timeout is disabled, which is default.
+ */
+static int
+sockobj_settimeout(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    double timeout = (double)luaL_checknumber(L, 2);
+    s->sock_timeout = timeout;
+    return 0;
+}
+
+/*
+ * timeout = sockobj:gettimeout()
+ *
+ * Returns the timeout in seconds associated with socket.
+ * A negative timeout indicates that timeout is disabled, which is default.
+ */
+static int
+sockobj_gettimeout(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
     lua_pushnumber(L, s->sock_timeout);
     return 1;
 }
 
 /**
- * ok, err = tcpsock:connect(host, port)
- * ok, err = tcpsock:connect("unix:/path/to/unix-domain.sock")
+ * sockobj:setdeadline(deadline)
+ * sockobj:setdeadline(seconds)
+ * sockobj:setdeadline(nil)
+ *
+ * Attach a deadline object to the socket: subsequent operations fail with
+ * ERROR_TIMEOUT rather than wait past it, whatever the socket timeout. A number
+ * makes a new deadline that many seconds from now, nil detaches it. Closing
+ * the socket detaches it as well.
+ */
+static int
+sockobj_setdeadline(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    if (lua_isnoneornil(L, 2)) {
+        s->deadline = -1;
+    } else if (lua_type(L, 2) == LUA_TNUMBER) {
+        s->deadline = timeout_gettime() + lua_tonumber(L, 2);
+    } else {
+        s->deadline = *(double *)luaL_checkudata(L, 2, DEADLINE_TYPENAME);
+    }
+    return 0;
+}
+
+/*** Connection pool ***
+ *
+ * Idle connections given back by tcpsock:setkeepalive() are kept by peer
+ * address, and handed out again by tcpsock:connect() to the same address.
+ */
+
+#define POOL_SIZE           30
+#define POOL_IDLE_TIMEOUT   60.0
+
+struct pooled {
+    struct pooled *next;        /* less recently used */
+    int fd;
+    double expires;             /* -1 if no idle timeout */
+};
+
+struct connpool {
+    struct connpool *next;
+    sockaddr_t addr;
+    int size;                   /* max idle connections */
+    int n;
+    struct pooled *head;        /* most recently used first */
+};
+
+static struct connpool *connpools;
+
+/* Pools are shared by Lua states that may run on different threads. */
+static pthread_mutex_t connpools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Compare the peer part of socket addresses.
+ */
+static int
+__addr_same(struct sockaddr *a, struct sockaddr *b)
+{
+    if (a->sa_family != b->sa_family)
+        return 0;
+    switch (a->sa_family) {
+    case AF_INET:
+        return ((struct sockaddr_in *)a)->sin_port == ((struct sockaddr_in *)b)->sin_port
+            && ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr;
+    case AF_UNIX:
+        return strncmp(((struct sockaddr_un *)a)->sun_path,
+                       ((struct sockaddr_un *)b)->sun_path,
+                       sizeof(((struct sockaddr_un *)a)->sun_path)) == 0;
+    default:
+        return 0;
+    }
+}
+
+static struct connpool *
+__connpool_find(struct sockaddr *addr)
+{
+    struct connpool *pool;
+    for (pool = connpools; pool; pool = pool->next) {
+        if (__addr_same(SAS2SA(&pool->addr), addr))
+            return pool;
+    }
+    return NULL;
+}
+
+/**
+ * Check that an idle connection is still usable: the peer has neither
+ * closed it nor sent anything since.
+ */
+static int
+__connpool_healthy(int fd)
+{
+    char c;
+    ssize_t n;
+    do {
+        n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+    return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * Take the most recently used healthy connection to addr, closing expired or
+ * broken ones on the way.
+ *
+ * Returns the fd, or -1 if none.
+ */
+static int
+__connpool_get(struct sockaddr *addr)
+{
+    struct connpool *pool;
+    double now = timeout_gettime_coarse();
+    pthread_mutex_lock(&connpools_lock);
+    pool = __connpool_find(addr);
+    while (pool && pool->head) {
+        struct pooled *c = pool->head;
+        int fd = c->fd;
+        pool->head = c->next;
+        pool->n--;
+        if ((c->expires < 0 || c->expires > now) && __connpool_healthy(fd)) {
+            free(c);
+            stats.pool_hits++;
+            pthread_mutex_unlock(&connpools_lock);
+            return fd;
+        }
+        free(c);
+        close(fd);
+    }
+    stats.pool_misses++;
+    pthread_mutex_unlock(&connpools_lock);
+    return -1;
+}
+
+/**
+ * Keep an idle connection to addr, evicting the least recently used ones if
+ * the pool is full. The pool of addr is created if needed, and resized to
+ * given size.
+ *
+ * Returns 0 on success, -1 on error (fd is left to caller).
+ */
+static int
+__connpool_put(struct sockaddr *addr, int fd, double idle, int size)
+{
+    struct connpool *pool;
+    struct pooled *c, **pc;
+    double now = timeout_gettime_coarse();
+
+    c = malloc(sizeof(*c));
+    if (!c)
+        return -1;
+    pthread_mutex_lock(&connpools_lock);
+    pool = __connpool_find(addr);
+    if (!pool) {
+        pool = calloc(1, sizeof(*pool));
+        if (!pool) {
+            pthread_mutex_unlock(&connpools_lock);
+            free(c);
+            return -1;
+        }
+        memcpy(&pool->addr, addr, addr->sa_family == AF_INET ?
+               sizeof(struct sockaddr_in) : sizeof(struct sockaddr_un));
+        pool->next = connpools;
+        connpools = pool;
+    }
+    pool->size = size;
+
+    // drop expired connections, then the oldest ones while still full
+    for (pc = &pool->head; *pc; ) {
+        struct pooled *old = *pc;
+        if (old->expires >= 0 && old->expires <= now) {
+            *pc = old->next;
+            close(old->fd);
+            free(old);
+            pool->n--;
+            continue;
+        }
+        pc = &old->next;
+    }
+    while (pool->n >= pool->size) {
+        struct pooled *old;
+        for (pc = &pool->head; (*pc)->next; pc = &(*pc)->next)
+            ;
+        old = *pc;
+        *pc = NULL;
+        close(old->fd);
+        free(old);
+        pool->n--;
+    }
+
+    c->fd = fd;
+    c->expires = idle > 0 ? now + idle : -1;
+    c->next = pool->head;
+    pool->head = c;
+    pool->n++;
+    pthread_mutex_unlock(&connpools_lock);
+    return 0;
+}
+
+/**
+ * ok, err = tcpsock:connect(host, port[, opts])
+ * ok, err = tcpsock:connect("unix:/path/to/unix-domain.sock")
+ *
+ * Attempts to connect to TCP socket object to a remote server or to a stream
+ * unix domain socket file. An idle connection to the same address kept by
+ * tcpsock:setkeepalive() is reused if there is a healthy one.
+ *
+ * After tcpsock:connect_start(), waits for the connection in progress.
+ *
+ * With opts.fastopen, a string, TCP Fast Open is used to send it in the SYN
+ * when possible; otherwise it is sent as soon as the connection is established.
+ * opts.deadline, a deadline object, bounds this call only.
+ */
+static int tcpsock_connect(lua_State *L);
+
+static int
+__tcpsock_connect(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    sockaddr_t addr;
+    socklen_t len;
+    const char *data = NULL;
+    size_t datalen = 0;
+    int opts;
+
+    if (s->fd > 0) {
+        if (s->connecting) {
+            // started by tcpsock:connect_start()
+            return __sockobj_connect_k(L);
+        }
+        return luaL_error(L, "already connected");
+    }
+    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1, tcpsock_connect)) {
+        return 2;
+    }
+    if ((opts = __sockobj_optsarg(L, 1)) != 0) {
+        // left on the stack, referenced until it is copied out
+        lua_getfield(L, opts, "fastopen");
+        if (!lua_isnil(L, -1)) {
+            luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, opts,
+                          "fastopen must be a string");
+            data = lua_tolstring(L, -1, &datalen);
+        }
+    }
+    if ((s->fd = __connpool_get(SAS2SA(&addr))) != -1) {
+        if (data && buffer_append(&s->wbuf, data, datalen) == -1) {
+            lua_pushnil(L);
+            lua_pushstring(L, strerror(errno));
+            return 2;
+        }
+    } else {
+        if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
+            return 2;
+        }
+        if (data) {
+            if (__sockobj_fastopen(L, s, SAS2SA(&addr), len, data, datalen) == -1)
+                return 2;
+        } else if (__sockobj_connect(L, s, SAS2SA(&addr), len) == -1) {
+            return 2;
+        }
+    }
+    if (__sockobj_connected(L, s) == -1)
+        return 2;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+tcpsock_connect(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    int opts = __sockobj_optsarg(L, 1);
+    double deadline = -1;
+    if (opts) {
+        lua_getfield(L, opts, "deadline");
+        deadline = __deadline_opt(L, -1);
+        lua_pop(L, 1);
+    }
+    return __sockobj_withdeadline(L, s, deadline, __tcpsock_connect);
+}
+
+/**
+ * ok, err = tcpsock:connect_start(host, port)
+ * ok, err = tcpsock:connect_start("unix:/path/to/unix-domain.sock")
+ *
+ * Start connecting without waiting for the connection to complete, so that
+ * connections to several servers proceed in parallel. Completion is waited
+ * for by tcpsock:connect() or socket.connect_all().
+ */
+static int
+tcpsock_connect_start(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    sockaddr_t addr;
+    socklen_t len;
+
+    if (s->fd > 0) {
+        return luaL_error(L, "already connected");
+    }
+    s->connerr = 0;
+    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1, tcpsock_connect_start)) {
+        return 2;
+    }
+    if ((s->fd = __connpool_get(SAS2SA(&addr))) != -1) {
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
+        return 2;
+    }
+    if (__sockobj_connectstart(L, s, SAS2SA(&addr), len) == -1)
+        return 2;
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * ok, err = tcpsock:setkeepalive([idle_timeout=60[, pool_size=30]])
+ *
+ * Put the connection into the pool of its peer address, instead of closing
+ * it, for tcpsock:connect() to reuse. It is closed if idle for more than
+ * idle_timeout seconds (0 for never). pool_size is the maximum number of idle
+ * connections to this address, the latest given applies; the least recently
+ * used ones are closed when full.
+ *
+ * The socket object is closed, as after tcpsock:close().
+ */
+static int
+tcpsock_setkeepalive(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    double idle = luaL_optnumber(L, 2, POOL_IDLE_TIMEOUT);
+    int size = luaL_optinteger(L, 3, POOL_SIZE);
+    sockaddr_t addr;
+    socklen_t len = sizeof(addr);
+    char *errstr = NULL;
+    int fd;
+
+    if (size <= 0)
+        return luaL_argerror(L, 3, "pool size must be positive");
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
+        goto err;
+    }
+    if (buffer_size(&s->buf) > 0 || s->piped > 0) {
+        errstr = "unread data in buffer";
+        goto err;
+    }
+    if (buffer_size(&s->wbuf) > 0) {
+        errstr = "unflushed data in write buffer";
+        goto err;
+    }
+    if (getpeername(s->fd, SAS2SA(&addr), &len) == -1) {
+        errstr = strerror(errno);
+        goto err;
+    }
+
+    fd = s->fd;
+    __sched_closefd(L, fd);
+    s->fd = -1;
+    __sockobj_close(L, s);
+    if (__connpool_put(SAS2SA(&addr), fd, idle, size) == -1) {
+        errstr = strerror(errno);
+        close(fd);
+        goto err;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+
+err:
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
+}
+
+/**
+ * Apply bind options of table at index idx to the socket, before bind():
+ *  - reuseaddr: SO_REUSEADDR
+ *  - reuseport: let several sockets bind the same address (SO_REUSEPORT),
+ *    the kernel spreads connections or datagrams between them
+ *  - incoming_cpu: prefer this socket for packets processed by given CPU
+ *    among the reuseport group (SO_INCOMING_CPU, Linux)
+ *
+ * Returns 0 on success, -1 on failure (error message set to errstr).
+ */
+static int
+__sockobj_bindopts(lua_State *L, struct sockobj *s, int idx, char **errstr)
+{
+    int on = 1;
+
+    if (!idx)
+        return 0;
+    lua_getfield(L, idx, "reuseaddr");
+    if (lua_toboolean(L, -1) &&
+        setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+        goto err;
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "reuseport");
+    if (lua_toboolean(L, -1)) {
+#if defined(SO_REUSEPORT)
+        if (setsockopt(s->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+            goto err;
+#else
+        errno = ENOPROTOOPT;
+        goto err;
+#endif
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "incoming_cpu");
+    if (!lua_isnil(L, -1)) {
+#if defined(SO_INCOMING_CPU)
+        int cpu = luaL_checkinteger(L, -1);
+        if (setsockopt(s->fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+            goto err;
+#else
+        errno = ENOPROTOOPT;
+        goto err;
+#endif
+    }
+    lua_pop(L, 1);
+    return 0;
+
+err:
+    lua_pop(L, 1);
+    *errstr = strerror(errno);
+    return -1;
+}
+
+/**
+ * ok, err = tcpsock:bind(host, port[, opts])
+ * ok, err = tcpsock:connect("unix:/path/to/unix-domain.sock")
+ *
+ * opts is an optional table of bind options, see __sockobj_bindopts().
+ */
+static int
+tcpsock_bind(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    sockaddr_t addr;
+    socklen_t len;
+    char *errstr = NULL;
+
+    if (s->fd > 0) {
+        return luaL_error(L, "already bound");
+    }
+    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1, tcpsock_bind)) {
+        return 2;
+    }
+    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
+        return 2;
+    }
+    if (__sockobj_bindopts(L, s, __sockobj_optsarg(L, 1), &errstr) == -1) {
+        __sockobj_close(L, s);
+        goto err;
+    }
+
+    if (bind(s->fd, SAS2SA(&addr), len) < 0) {
+        errstr = strerror(errno);
+        goto err;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
+}
+
+/**
+ * ok, err = tcpsock:listen(backlog[, opts])
+ *
+ * Listen for connections make to the socket.
+ * The backlog argument specifies the maximum number of queue connections and
+ * should be at least 0.
+ *
+ * With opts.fastopen, TCP Fast Open is enabled with given queue length of
+ * pending fast open requests.
+ */
+static int
+tcpsock_listen(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    int backlog;
+    int ret;
+    char *errstr = NULL;
+    backlog = luaL_checknumber(L, 2);
+    /* To avoid problems on systems that don't allow a negative backlog, force
+     * minimu value of 0. */
+    if (backlog < 0) {
+        backlog = 0;
+    }
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "fastopen");
+        if (!lua_isnil(L, -1)) {
+#if defined(TCP_FASTOPEN)
+            int qlen = luaL_checkinteger(L, -1);
+            if (setsockopt(s->fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0) {
+                errstr = strerror(errno);
+                goto err;
+            }
+            s->fastopen = qlen > 0;
+#else
+            errstr = strerror(ENOPROTOOPT);
+            goto err;
+#endif
+        }
+        lua_pop(L, 1);
+    }
+    ret = listen(s->fd, backlog);
+    if (ret < 0) {
+        errstr = strerror(errno);
+        goto err;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
+}
+
+/**
+ * sock, err = tcpsock:accept()
+ *
+ * Accept a connection. The socket must be bound to an address and listening for
+ * connections.
+ *
+ * In case of success, it returns a socket object usable to read/write data on
+ * the connection. Otherwise, it returns nil and a string describing the error.
+ */
+static int
+tcpsock_accept(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    sockaddr_t addr;
+    socklen_t addrlen;
+    int clientfd;
+    char *errstr = NULL;
+
+    if (!__getsockaddrlen(s, &addrlen)) {
+        errstr = strerror(errno);
+        goto err;
+    }
+
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm);
+    while (1) {
+        clientfd = __accept(s->fd, SAS2SA(&addr), &addrlen);
+        if (clientfd != -1) {
+            if (!s->waited)
+                stats.io_fast++;
+            break;
+        }
+        switch (errno) {
+        case EINTR:
+        case ECONNABORTED:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            break;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        int timeout = __waitfd(L, s, EVENT_READABLE, &tm, tcpsock_accept);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
+    }
+
+    struct sockobj *client = __sockobj_create(L, TCPSOCK_TYPENAME);
+    if (!client) {
+        close(clientfd);
+        return luaL_error(L, "out of memory");
+    }
+    client->fd = clientfd;
+    client->sock_family = s->sock_family;
+    if (s->fastopen && __sockobj_synacked(client))
+        stats.tfo_accepts++;
+    return 1;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
+}
+
+/**
+ * socks, err = tcpsock:acceptmany([max=64])
  *
- * Attempts to connect to TCP socket object to a remote server or to a stream
- * unix domain socket file.
+ * Accept up to max pending connections at once, waiting only if there is
+ * none. Returns an array of the new socket objects.
+ *
+ * The accept queue is drained until it would block, so a burst of
+ * connections costs one system call each. An error occurring after some
+ * connections were accepted is reported by next call.
  */
 static int
-tcpsock_connect(lua_State * L)
+tcpsock_acceptmany(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
+    int max = luaL_optinteger(L, 2, ACCEPT_MAX);
     sockaddr_t addr;
-    socklen_t len;
+    socklen_t socklen, addrlen;
+    struct timeout tm;
+    int clientfd, n = 0;
+    char *errstr = NULL;
 
-    if (s->fd > 0) {
-        return luaL_error(L, "already connected");
+    luaL_argcheck(L, max > 0, 2, "max must be positive");
+    lua_settop(L, 2);
+    if (!__getsockaddrlen(s, &socklen)) {
+        errstr = strerror(errno);
+        goto err;
     }
-    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1)) {
-        return 2;
+
+    __sockobj_inittimeout(L, s, &tm);
+    while (n < max) {
+        addrlen = socklen;
+        clientfd = __accept(s->fd, SAS2SA(&addr), &addrlen);
+        if (clientfd != -1) {
+            if (n == 0)
+                lua_createtable(L, max < 16 ? max : 16, 0);
+            struct sockobj *client = __sockobj_create(L, TCPSOCK_TYPENAME);
+            if (!client) {
+                close(clientfd);
+                return luaL_error(L, "out of memory");
+            }
+            client->fd = clientfd;
+            client->sock_family = s->sock_family;
+            if (s->fastopen && __sockobj_synacked(client))
+                stats.tfo_accepts++;
+            lua_rawseti(L, -2, ++n);
+            continue;
+        }
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if (n > 0)
+            break;
+        if (errno != EAGAIN) {
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        stats.io_waits++;
+        int timeout = __waitfd(L, s, EVENT_READABLE, &tm, tcpsock_acceptmany);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
     }
-    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
-        return 2;
+    if (!s->waited)
+        stats.io_fast++;
+    return 1;
+
+err:
+    assert(errstr);
+    lua_pushnil(L);
+    lua_pushstring(L, errstr);
+    return 2;
+}
+
+/**
+ * bytes, err = tcpsock:write(data[, deadline])
+ * bytes, err = tcpsock:write({data1, data2, ...}[, deadline])
+ *
+ * This method is a synchronous operation that will not return until all the
+ * data has been flushed into the system socket send buffer or an error occurs.
+ *
+ * A table of strings is written with a single vectored write, without
+ * concatenating them first.
+ *
+ * If buffered writing is enabled (see tcpsock:setwritebuffer), data is only
+ * appended to the write buffer until it reaches the watermark.
+ *
+ * In case of success, it returns the total number of bytes that have been sent.
+ * Otherwise, it returns nil and a string describing the error.
+ */
+static int tcpsock_write(lua_State *L);
+
+static int
+__tcpsock_write(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    struct iovec stack[IOV_STACKSIZE];
+    struct iovec *iov;
+    int i, iovcnt;
+    size_t len;
+    int flags = 0;
+
+    iov = __sockobj_checkiov(L, 2, stack, &iovcnt, &len);
+
+    if (s->wbuf_watermark > 0 && s->fd != -1) {
+        // Appending while a write is parked would reorder data, and a
+        // resumed write has already sent part of it.
+        if (buffer_size(&s->wbuf) + len < s->wbuf_watermark &&
+            !__sched_waiting(L, s->fd, EVENT_WRITABLE) &&
+            !__sockobj_resumed(L, s)) {
+            for (i = 0; i < iovcnt; i++) {
+                if (buffer_append(&s->wbuf, iov[i].iov_base, iov[i].iov_len) == -1) {
+                    lua_pushnil(L);
+                    lua_pushstring(L, strerror(ENOMEM));
+                    return 2;
+                }
+            }
+            lua_pushinteger(L, len);
+            return 1;
+        }
+        // More data will follow, let the kernel hold the last partial
+        // segment until tcpsock:flush().
+        flags = MSG_MORE;
     }
-    if (__sockobj_connect(L, s, SAS2SA(&addr), len) == -1)
+
+    if (__sockobj_write(L, s, iov, iovcnt, len, flags, tcpsock_write) == -1)
         return 2;
 
-    lua_pushboolean(L, 1);
     return 1;
 }
 
+static int
+tcpsock_write(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    return __sockobj_withdeadline(L, s, __deadline_opt(L, 3), __tcpsock_write);
+}
+
 /**
- * ok, err = tcpsock:bind(host, port)
- * ok, err = tcpsock:connect("unix:/path/to/unix-domain.sock")
+ * Push out the last partial segment held back by writes with MSG_MORE:
+ * setting TCP_NODELAY flushes pending output, the previous value is restored.
  */
 static int
-tcpsock_bind(lua_State * L)
+__sockobj_push(struct sockobj *s)
+{
+    int on = 1, nodelay;
+    socklen_t optlen = sizeof(nodelay);
+
+    if (s->fd == -1 || s->sock_family == AF_UNIX)
+        return 0;
+    if (getsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &optlen) == -1)
+        return -1;
+    // pushes even if already set
+    if (setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1)
+        return -1;
+    if (nodelay)
+        return 0;
+    return setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+/**
+ * ok, err = tcpsock:flush()
+ *
+ * Write all pending data of the write buffer, and push out the last partial
+ * segment.
+ *
+ * In case of success, it returns true. Otherwise, it returns nil and a string
+ * describing the error.
+ */
+static int
+tcpsock_flush(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    sockaddr_t addr;
-    socklen_t len;
-    char *errstr = NULL;
+    struct iovec stack[1];
+    // without pending data, no send pushes out what MSG_MORE held back
+    int push = s->wbuf_watermark > 0 && buffer_size(&s->wbuf) == 0;
 
-    if (s->fd > 0) {
-        return luaL_error(L, "already bound");
-    }
-    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1)) {
+    if (__sockobj_write(L, s, stack + 1, 0, 0, 0, tcpsock_flush) == -1)
         return 2;
-    }
-    if (__sockobj_createsocket(L, s, SOCK_STREAM) == -1) {
+    if (push && __sockobj_push(s) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
         return 2;
     }
 
-    if (bind(s->fd, SAS2SA(&addr), len) < 0) {
-        errstr = strerror(errno);
-        goto err;
-    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * ok, err = tcpsock:setwritebuffer(size)
+ *
+ * Enable buffered writing: writes are collected until size bytes are pending,
+ * then sent together. Size 0 disables it, data still pending is sent by next
+ * write or tcpsock:flush().
+ */
+static int
+tcpsock_setwritebuffer(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    lua_Integer size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0, 2, "size must not be negative");
+
+    s->wbuf_watermark = size;
 
     lua_pushboolean(L, 1);
     return 1;
+}
 
-err:
-    assert(errstr);
-    lua_pushnil(L);
-    lua_pushstring(L, errstr);
-    return 2;
+/**
+ * ok, err = tcpsock:setreadbuffer(size)
+ *
+ * Make room for size bytes on each receive instead of adapting it to the
+ * traffic. Size 0 goes back to adaptive sizing.
+ */
+static int
+tcpsock_setreadbuffer(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    lua_Integer size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0 && size <= BUFFER_MAXSIZE, 2, "size out of range");
+
+    s->rsize_fixed = size > 0;
+    s->rsize = size > 0 ? (size_t)size : RECV_BUFSIZE;
+
+    lua_pushboolean(L, 1);
+    return 1;
 }
 
 /**
- * ok, err = tcpsock:listen(backlog)
+ * Get a file descriptor from function argument idx: a file descriptor
+ * number, a Lua file object, or a path which is opened for reading, in
+ * which case *owned is set and the caller must close it.
  *
- * Listen for connections make to the socket.
- * The backlog argument specifies the maximum number of queue connections and
- * should be at least 0.
+ * Returns the file descriptor, or -1 on error with errno set.
  */
 static int
-tcpsock_listen(lua_State * L)
+__checkfd(lua_State *L, int idx, int *owned)
+{
+    luaL_Stream *p;
+    *owned = 0;
+
+    if (lua_type(L, idx) == LUA_TNUMBER)
+        return lua_tointeger(L, idx);
+    if ((p = luaL_testudata(L, idx, LUA_FILEHANDLE)) != NULL) {
+        if (p->closef == NULL) {
+            errno = EBADF;
+            return -1;
+        }
+        fflush(p->f);
+        return fileno(p->f);
+    }
+    *owned = 1;
+    return open(luaL_checkstring(L, idx), O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Send count bytes of file fd from offset on socket sockfd, like
+ * sendfile(2). Other systems fall back to pread() and send().
+ */
+static ssize_t
+__sendfile(int sockfd, int fd, off_t offset, size_t count)
+{
+#if defined(__linux__)
+    return sendfile(sockfd, fd, &offset, count);
+#else
+    char buf[16384];
+    ssize_t n = pread(fd, buf, count < sizeof(buf) ? count : sizeof(buf), offset);
+    if (n <= 0)
+        return n;
+    return send(sockfd, buf, n, 0);
+#endif
+}
+
+/**
+ * bytes, err, sent = tcpsock:sendfile(file, offset?, len?)
+ *
+ * Send len bytes (default: up to the end) of file from offset (default: 0),
+ * from kernel to socket without copying data in user space. File is either a
+ * path, a Lua file object, or a file descriptor.
+ *
+ * In case of success, it returns the number of bytes sent, which is less than
+ * len only if the file is shorter. Otherwise, it returns nil, a string
+ * describing the error, and the number of bytes sent.
+ */
+static int
+tcpsock_sendfile(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    int backlog;
-    int ret;
+    lua_Integer offset = luaL_optinteger(L, 3, 0);
+    lua_Integer len = luaL_optinteger(L, 4, -1);
+    lua_Integer sent = 0;
     char *errstr = NULL;
-    backlog = luaL_checknumber(L, 2);
-    /* To avoid problems on systems that don't allow a negative backlog, force
-     * minimu value of 0. */
-    if (backlog < 0) {
-        backlog = 0;
-    }
-    ret = listen(s->fd, backlog);
-    if (ret < 0) {
-        errstr = strerror(ret);
+    int fd = -1, owned = 0;
+    luaL_argcheck(L, offset >= 0, 3, "must not be negative");
+
+    if (s->fd == -1) {
+        errstr = ERROR_CLOSED;
         goto err;
     }
 
-    lua_pushboolean(L, 1);
+    // data written before must go first
+    if (buffer_size(&s->wbuf) > 0) {
+        struct iovec stack[1];
+        if (__sockobj_write(L, s, stack + 1, 0, 0, 0, tcpsock_sendfile) == -1)
+            return 2;
+        lua_pop(L, 1);
+    }
+
+    struct timeout tm;
+    if (__sockobj_inittimeout(L, s, &tm)) {
+        // resume a transfer parked by scheduler
+        sent = s->wsent;
+    }
+
+    while (len < 0 || sent < len) {
+        if (fd == -1 && (fd = __checkfd(L, 2, &owned)) == -1) {
+            errstr = strerror(errno);
+            goto err;
+        }
+        if (len < 0) {
+            struct stat st;
+            if (fstat(fd, &st) == -1) {
+                errstr = strerror(errno);
+                goto err;
+            }
+            len = st.st_size > offset ? st.st_size - offset : 0;
+            continue;
+        }
+
+        ssize_t n = __sendfile(s->fd, fd, offset + sent, len - sent);
+        if (n > 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            sent += n;
+            continue;
+        } else if (n == 0) {
+            // end of file
+            break;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            break;
+        case EPIPE:
+            errstr = ERROR_CLOSED;
+            goto err;
+        default:
+            errstr = strerror(errno);
+            goto err;
+        }
+
+        s->wsent = sent;
+        if (owned) {
+            // don't leak it if parked, it is opened again after waiting
+            close(fd);
+            fd = -1;
+        }
+        int timeout = __waitfd(L, s, EVENT_WRITABLE, &tm, tcpsock_sendfile);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
+    }
+
+    if (owned && fd != -1)
+        close(fd);
+    lua_pushinteger(L, sent);
     return 1;
 
 err:
     assert(errstr);
+    if (owned && fd != -1)
+        close(fd);
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    return 2;
+    lua_pushinteger(L, sent);
+    return 3;
+}
+
+/**
+ * Adapt the recv size of s after a recv of n bytes into avail bytes: double it
+ * when it filled the room given (bulk transfer), halve it when it got a small
+ * fraction of it (chatty connection). When the room was filled, FIONREAD tells
+ * how much more is waiting, so that the next recv can take it all at once.
+ */
+static void
+__sockobj_adaptrecv(struct sockobj *s, size_t n, size_t avail)
+{
+    int pending;
+    s->rpending = 0;
+    if (n == avail) {
+        if (!s->rsize_fixed && s->rsize < RECV_MAXSIZE)
+            s->rsize *= 2;
+        if (ioctl(s->fd, FIONREAD, &pending) == 0 && pending > 0)
+            s->rpending = pending < RECV_MAXSIZE ? pending : RECV_MAXSIZE;
+    } else if (!s->rsize_fixed && n < s->rsize / 4 && s->rsize > RECV_MINSIZE) {
+        s->rsize /= 2;
+    }
+}
+
+/**
+ * Receive more data into the read buffer, wait for the socket to be readable
+ * only if nothing is available yet. Room is made for the adaptive recv size
+ * of the socket, or for what is known to be waiting if more.
+ *
+ * Returns 0 on success, -1 on error with errstr set.
+ */
+static int
+__sockobj_fill(lua_State *L, struct sockobj *s, struct timeout *tm, lua_CFunction k, char **errstr)
+{
+    struct buffer *buf = &s->buf;
+
+    if (s->fd == -1) {
+        *errstr = ERROR_CLOSED;
+        return -1;
+    }
+
+    while (1) {
+        size_t want = s->rpending > s->rsize ? s->rpending : s->rsize;
+        if (buffer_reserve(buf, want) == -1) {
+            *errstr = strerror(errno);
+            return -1;
+        }
+        size_t avail = buffer_available(buf);
+        int bytes_read = recv(s->fd, buf->last, avail, 0);
+        if (bytes_read > 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            buf->last += bytes_read;
+            __sockobj_adaptrecv(s, bytes_read, avail);
+            return 0;
+        } else if (bytes_read == 0) {
+            *errstr = ERROR_CLOSED;
+            return -1;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            stats.io_waits++;
+            s->rpending = 0;
+            break;
+        default:
+            *errstr = strerror(errno);
+            return -1;
+        }
+
+        if (buffer_size(buf) == 0) {
+            // don't hold memory while idle
+            buffer_free(buf);
+        }
+        int timeout = __waitfd(L, s, EVENT_READABLE, tm, k);
+        if (timeout == -1) {
+            *errstr = strerror(errno);
+            return -1;
+        } else if (timeout == 1) {
+            *errstr = ERROR_TIMEOUT;
+            return -1;
+        }
+    }
 }
 
 /**
- * sock, err = tcpsock:accept()
+ * Init the timeout of an operation waiting on socket s or dst.
  *
- * Accept a connection. The socket must be bound to an address and listening for
- * connections.
+ * Returns 1 if resuming an operation parked by scheduler, 0 otherwise.
+ */
+static int
+__sockobj_inittimeout2(lua_State *L, struct sockobj *s, struct sockobj *dst, struct timeout *tm)
+{
+    struct sched *sc = __sched_current(L);
+    if (dst && sc && sc->resumed && dst->fd != -1 && sc->resumed->fd == dst->fd)
+        return __sockobj_inittimeout(L, dst, tm);
+    return __sockobj_inittimeout(L, s, tm);
+}
+
+/**
+ * Move up to max bytes received on socket s to dst socket, or to file
+ * descriptor dstfd if dst is NULL.
  *
- * In case of success, it returns a socket object usable to read/write data on
- * the connection. Otherwise, it returns nil and a string describing the error.
+ * Data already in the read buffer of s is written first. Otherwise it waits
+ * for data and moves it through a pipe owned by s with splice(2), so it never
+ * enters user space; other systems receive it in the read buffer instead.
+ *
+ * Pushes the number of bytes moved, or nil and a string describing the
+ * error, and returns the number of values pushed.
  */
 static int
-tcpsock_accept(lua_State * L)
+__sockobj_splice(lua_State *L, struct sockobj *s, struct sockobj *dst, int dstfd, size_t max, lua_CFunction k)
 {
-    struct sockobj *s = getsockobj(L);
-    sockaddr_t addr;
-    socklen_t addrlen;
-    int clientfd;
     char *errstr = NULL;
+    struct buffer *buf = &s->buf;
 
-    if (!__getsockaddrlen(s, &addrlen)) {
-        errstr = strerror(errno);
+    if (s->fd == -1 || dstfd == -1) {
+        errstr = ERROR_CLOSED;
         goto err;
     }
+    if (dst && buffer_size(&dst->wbuf) > 0) {
+        // data written before must go first
+        struct iovec stack[1];
+        if (__sockobj_write(L, dst, stack + 1, 0, 0, 0, k) == -1)
+            return 2;
+        lua_pop(L, 1);
+    }
+
+#if !defined(__linux__)
+    if (buffer_size(buf) == 0) {
+        struct timeout tm;
+        __sockobj_inittimeout(L, s, &tm);
+        if (__sockobj_fill(L, s, &tm, k, &errstr) == -1)
+            goto err;
+    }
+#endif
+
+    if (buffer_size(buf) > 0) {
+        struct iovec iov[2];
+        size_t n = buffer_size(buf) < max ? buffer_size(buf) : max;
+        iov[1].iov_base = buf->pos;
+        iov[1].iov_len = n;
+        if (dst) {
+            if (__sockobj_write(L, dst, iov + 1, 1, n, 0, k) == -1)
+                return 2;
+            lua_pop(L, 1);
+        } else {
+            size_t total = 0;
+            while (total < n) {
+                ssize_t w = write(dstfd, buf->pos + total, n - total);
+                if (w == -1 && errno != EINTR) {
+                    errstr = strerror(errno);
+                    goto err;
+                }
+                if (w > 0)
+                    total += w;
+            }
+        }
+        buffer_consume(buf, n);
+        lua_pushinteger(L, n);
+        return 1;
+    }
 
+#if defined(__linux__)
+    size_t moved = 0;
+    int waited = 0;
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
-    int timeout = __waitfd(s, EVENT_READABLE, &tm);
-    if (timeout == -1) {
+    if (__sockobj_inittimeout2(L, s, dst, &tm)) {
+        // resume a move parked by scheduler
+        moved = s->spliced;
+        waited = 1;
+    }
+    if (s->pipefd[0] == -1 && pipe2(s->pipefd, O_NONBLOCK | O_CLOEXEC) == -1) {
         errstr = strerror(errno);
         goto err;
-    } else if (timeout == 1) {
-        errstr = ERROR_TIMEOUT;
-        goto err;
-    } else {
-        clientfd = accept(s->fd, SAS2SA(&addr), &addrlen);
-        if (clientfd == -1) {
+    }
+
+    while (1) {
+        ssize_t n;
+        struct sockobj *waitobj;
+        int event;
+        if (s->piped > 0) {
+            n = splice(s->pipefd[0], NULL, dstfd, NULL, s->piped,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                // waits may be on either socket
+                if (!waited)
+                    stats.io_fast++;
+                s->piped -= n;
+                moved += n;
+                if (s->piped == 0)
+                    break;
+                continue;
+            }
+            waitobj = dst;
+            event = EVENT_WRITABLE;
+        } else {
+            n = splice(s->fd, NULL, s->pipefd[1], NULL, max,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                s->piped = n;
+                continue;
+            } else if (n == 0) {
+                errstr = ERROR_CLOSED;
+                goto err;
+            }
+            waitobj = s;
+            event = EVENT_READABLE;
+        }
+        switch (errno) {
+        case EINTR:
+            continue;
+        case EAGAIN:
+            if (waitobj == NULL) {
+                // a file, not waited for
+                errstr = strerror(errno);
+                goto err;
+            }
+            stats.io_waits++;
+            waited = 1;
+            break;
+        case EPIPE:
+            errstr = ERROR_CLOSED;
+            goto err;
+        default:
             errstr = strerror(errno);
             goto err;
         }
-    }
 
-    struct sockobj *client = __sockobj_create(L, TCPSOCK_TYPENAME);
-    client->fd = clientfd;
-    client->sock_family = s->sock_family;
-    if (!client) {
-        return luaL_error(L, "out of memory");
+        s->spliced = moved;
+        int timeout = __waitfd(L, waitobj, event, &tm, k);
+        if (timeout == -1) {
+            errstr = strerror(errno);
+            goto err;
+        } else if (timeout == 1) {
+            errstr = ERROR_TIMEOUT;
+            goto err;
+        }
     }
+
+    lua_pushinteger(L, moved);
     return 1;
+#endif
 
 err:
     assert(errstr);
@@ -1042,42 +4280,136 @@ err:
 }
 
 /**
- * bytes, err = tcpsock:write(data)
+ * bytes, err = socket.splice(src, dst, maxbytes?)
  *
- * This method is a synchronous operation that will not return until all the
- * data has been flushed into the system socket send buffer or an error occurs.
+ * Move up to maxbytes (default 65536) bytes received on tcp socket src to tcp
+ * socket dst, without copying them into user space or Lua strings.
  *
- * In case of success, it returns the total number of bytes that have been sent.
- * Otherwise, it returns nil and a string describing the error.
+ * It waits for some data to be received, and returns once all of it has been
+ * written, with the number of bytes moved. Otherwise, it returns nil and a
+ * string describing the error; socket.ERROR_CLOSED when src reached end of
+ * stream.
  */
 static int
-tcpsock_write(lua_State * L)
+socket_splice(lua_State * L)
+{
+    struct sockobj *src = luaL_checkudata(L, 1, TCPSOCK_TYPENAME);
+    struct sockobj *dst = luaL_checkudata(L, 2, TCPSOCK_TYPENAME);
+    lua_Integer max = luaL_optinteger(L, 3, SPLICE_BUFSIZE);
+    luaL_argcheck(L, max > 0, 3, "must be positive");
+
+    return __sockobj_splice(L, src, dst, dst->fd, max, socket_splice);
+}
+
+/**
+ * bytes, err = tcpsock:copyto(file, maxbytes?)
+ *
+ * Works like socket.splice, moving data received on the socket to a file,
+ * given as a Lua file object or a file descriptor.
+ */
+static int
+tcpsock_copyto(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    size_t len;
-    const char *buf = luaL_checklstring(L, 2, &len);
+    lua_Integer max = luaL_optinteger(L, 3, SPLICE_BUFSIZE);
+    luaL_Stream *p;
+    int fd;
+    luaL_argcheck(L, max > 0, 3, "must be positive");
 
-    if (__sockobj_write(L, s, buf, len) == -1)
-        return 2;
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        fd = lua_tointeger(L, 2);
+    } else {
+        p = luaL_checkudata(L, 2, LUA_FILEHANDLE);
+        if (p->closef == NULL)
+            return luaL_argerror(L, 2, "attempt to use a closed file");
+        fflush(p->f);
+        fd = fileno(p->f);
+    }
+
+    return __sockobj_splice(L, s, NULL, fd, max, tcpsock_copyto);
+}
+
+/**
+ * Receive size bytes straight into a userdata of that size, after the data
+ * already in the read buffer, so that the read buffer does not grow to size.
+ * The result string is copied from it (Lua cannot make a string in place), so
+ * each byte is still copied twice in user space, as with the read buffer, but
+ * a parked read does not copy what it received so far again on each resume.
+ *
+ * The userdata is anchored in the registry until the read completes, so a
+ * managed coroutine parks with the bytes received so far kept in place: 0 is
+ * returned for the caller to park, and the read continues on resume. Other
+ * callers wait in place.
+ *
+ * Returns 1 with the data pushed, 0 to wait, or -1 on error with errstr set.
+ */
+static int
+__sockobj_readdirect(lua_State *L, struct sockobj *s, size_t size,
+                     struct timeout *tm, char **errstr)
+{
+    struct buffer *buf = &s->buf;
+    int managed = __sched_current(L) != NULL;
+    ssize_t n;
+
+    if (!s->rdirect) {
+        s->rdirect = lua_newuserdata(L, size);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, s);
+        s->rdirect_size = size;
+        s->rdirect_got = buffer_size(buf);
+        if (s->rdirect_got > 0) {
+            memcpy(s->rdirect, buf->pos, s->rdirect_got);
+            buffer_consume(buf, s->rdirect_got);
+        }
+    }
+    while (s->rdirect_got < size) {
+        n = recv(s->fd, s->rdirect + s->rdirect_got, size - s->rdirect_got, 0);
+        if (n > 0) {
+            if (!s->waited)
+                stats.io_fast++;
+            s->rdirect_got += n;
+            continue;
+        } else if (n == 0) {
+            *errstr = ERROR_CLOSED;
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN) {
+            *errstr = strerror(errno);
+            return -1;
+        }
+        stats.io_waits++;
+        if (managed)
+            return 0;
+        int timeout = __waitfd(L, s, EVENT_READABLE, tm, NULL);
+        if (timeout == -1) {
+            *errstr = strerror(errno);
+            return -1;
+        } else if (timeout == 1) {
+            *errstr = ERROR_TIMEOUT;
+            return -1;
+        }
+    }
 
+    lua_pushlstring(L, s->rdirect, size);
+    __sockobj_dropdirect(L, s, 0);
     return 1;
 }
 
 /**
- * data, err, partial = tcpsock:read(size)
+ * data, err, partial = tcpsock:read(size[, deadline])
+ *
+ * Reads of RECV_DIRECT_MIN bytes or more bypass the read buffer, see
+ * __sockobj_readdirect().
  */
+static int tcpsock_read(lua_State *L);
+
 static int
-tcpsock_read(lua_State * L)
+__tcpsock_read(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
     size_t size = (int)luaL_checknumber(L, 2);
     char *errstr = NULL;
-    struct buffer *buf = NULL;
-
-    if (s->buf == NULL) {
-        s->buf = buffer_create(RECV_BUFSIZE);
-    }
-    buf = s->buf;
+    struct buffer *buf = &s->buf;
 
     if (s->fd == -1) {
         errstr = ERROR_CLOSED;
@@ -1085,194 +4417,212 @@ tcpsock_read(lua_State * L)
     }
 
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm);
 
-again:
-    if (buffer_size(buf) >= size) {
-        goto success;
+    if (s->rdirect && s->rdirect_size != size) {
+        // left by an interrupted read, its data comes first
+        if (__sockobj_dropdirect(L, s, 1) == -1) {
+            errstr = strerror(errno);
+            goto err;
+        }
     }
-
-    while (1) {
-        int timeout = __waitfd(s, EVENT_READABLE, &tm);
-        if (timeout == -1) {
+    while (s->rdirect ||
+           (size > buffer_size(buf) && size - buffer_size(buf) >= RECV_DIRECT_MIN)) {
+        int ret = __sockobj_readdirect(L, s, size, &tm, &errstr);
+        if (ret == 1)
+            return 1;
+        else if (ret == -1)
+            goto err;
+        // managed coroutine, park with the data kept by s->rdirect
+        ret = __waitfd(L, s, EVENT_READABLE, &tm, tcpsock_read);
+        if (ret == -1) {
             errstr = strerror(errno);
             goto err;
-        } else if (timeout == 1) {
+        } else if (ret == 1) {
             errstr = ERROR_TIMEOUT;
             goto err;
-        } else {
-            if (buffer_available(buf) < RECV_BUFSIZE) {
-                buffer_grow(buf, RECV_BUFSIZE - buffer_available(buf));
-            }
-            int bytes_read = recv(s->fd, buf->last, RECV_BUFSIZE, 0);
-            if (bytes_read > 0) {
-                buf->last += bytes_read;
-                goto again;
-            } else if (bytes_read == 0) {
-                errstr = ERROR_CLOSED;
-                goto err;
-            } else {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    // do nothing, continue
-                    continue;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            }
         }
     }
 
-success:
+    // make room for the whole message at once
+    if (buffer_size(buf) < size && buffer_reserve(buf, size - buffer_size(buf)) == -1) {
+        errstr = strerror(errno);
+        goto err;
+    }
+    while (buffer_size(buf) < size) {
+        if (__sockobj_fill(L, s, &tm, tcpsock_read, &errstr) == -1)
+            goto err;
+    }
+
     assert(buffer_size(buf) >= size);
     lua_pushlstring(L, buf->pos, size);
-    buf->pos += size;
-    buffer_shrink(buf);
+    buffer_consume(buf, size);
     return 1;
 
 err:
     assert(errstr);
+    // partial data of a direct read is returned too
+    __sockobj_dropdirect(L, s, 1);
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    lua_pushlstring(L, buf->pos, buf->last - buf->pos);
-    buf->pos = buf->last;
-    buffer_shrink(buf);
+    lua_pushlstring(L, buf->pos, buffer_size(buf));
+    buffer_consume(buf, buffer_size(buf));
     return 3;
 }
 
 static int
-tcpsock_readuntil_iterator(lua_State *L)
+tcpsock_read(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    return __sockobj_withdeadline(L, s, __deadline_opt(L, 3), __tcpsock_read);
+}
+
+/**
+ * Find pattern in data, like memmem(3).
+ *
+ * One and two byte delimiters, the common case ("\n", "\r\n"), are searched
+ * with memchr(). Longer patterns use memmem() on Linux (Two-Way algorithm),
+ * or memchr() for the first byte otherwise.
+ */
+static const char *
+__memfind(const char *data, size_t size, const char *pattern, size_t len)
+{
+    const char *p = data;
+    const char *end = data + size;
+
+    if (size < len)
+        return NULL;
+    if (len == 1)
+        return memchr(data, pattern[0], size);
+    if (len == 2) {
+        while (p < end - 1 && (p = memchr(p, pattern[0], end - 1 - p)) != NULL) {
+            if (p[1] == pattern[1])
+                return p;
+            p++;
+        }
+        return NULL;
+    }
+#if defined(__linux__)
+    return memmem(data, size, pattern, len);
+#else
+    while (p <= end - len && (p = memchr(p, pattern[0], end - len + 1 - p)) != NULL) {
+        if (memcmp(p, pattern, len) == 0)
+            return p;
+        p++;
+    }
+    return NULL;
+#endif
+}
+
+/**
+ * Iterator returned by tcpsock:readuntil.
+ *
+ * Upvalues: socket object, pattern, inclusive, the number of bytes at start
+ * of the read buffer already searched, so data is not searched again when
+ * more is received, and the deadline given to tcpsock:readuntil (or nil).
+ */
+static int tcpsock_readuntil_iterator(lua_State *L);
+
+static int
+__tcpsock_readuntil_iterator(lua_State *L)
 {
     struct sockobj *s = lua_touserdata(L, lua_upvalueindex(1));
     char *errstr = NULL;
     size_t len;
     const char *pattern = lua_tolstring(L, lua_upvalueindex(2), &len);
-    int state = lua_tointeger(L, lua_upvalueindex(4));
     int inclusive = lua_toboolean(L, lua_upvalueindex(3));
+    size_t scanned = lua_tointeger(L, lua_upvalueindex(4));
+    const char *match;
 
-    if (s->buf == NULL) {
-        s->buf = buffer_create(RECV_BUFSIZE);
-    }
-    struct buffer *buf = s->buf;
+    struct buffer *buf = &s->buf;
 
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
-
-again:
-    do {
-        int i = 0;
-        int bytes = buffer_size(buf);
-        if (bytes == 0) {
-            break;
-        }
-        while (i < bytes) {
-            char c = buf->pos[i];
-
-            if (c == pattern[state]) {
-                i++;
-                state++;
-                if (state == (int)len) {
-                    /* matched */
-                    buf->pos += i;
-                    state = 0;
-                    lua_pushinteger(L, state);
-                    lua_replace(L, lua_upvalueindex(4));
-                    goto matched;
-                }
-                continue;
-            }
-
-            if (state == 0) {
-                i++;
-                continue;
-            }
+    __sockobj_inittimeout(L, s, &tm);
 
-            state = 0;
+    while (1) {
+        size_t size = buffer_size(buf);
+        if (scanned > size) {
+            // buffer was consumed by another read
+            scanned = 0;
         }
+        match = __memfind(buf->pos + scanned, size - scanned, pattern, len);
+        if (match)
+            break;
 
-        buf->pos += i;
-        lua_pushinteger(L, state);
+        // the last len - 1 bytes may be the start of a match
+        scanned = size >= len ? size - len + 1 : 0;
+        lua_pushinteger(L, scanned);
         lua_replace(L, lua_upvalueindex(4));
-    } while (0);
 
-    while (1) {
-        int timeout = __waitfd(s, EVENT_READABLE, &tm);
-        if (timeout == -1) {
-            errstr = strerror(errno);
-            goto err;
-        } else if (timeout == 1) {
-            errstr = ERROR_TIMEOUT;
+        if (__sockobj_fill(L, s, &tm, tcpsock_readuntil_iterator, &errstr) == -1)
             goto err;
-        } else {
-            if (buffer_available(buf) < RECV_BUFSIZE) {
-                buffer_grow(buf, RECV_BUFSIZE - buffer_available(buf));
-            }
-            int bytes_read = recv(s->fd, buf->last, RECV_BUFSIZE, 0);
-            if (bytes_read > 0) {
-                buf->last += bytes_read;
-                goto again;
-            } else if (bytes_read == 0) {
-                errstr = ERROR_CLOSED;
-                goto err;
-            } else {
-                switch (errno) {
-                case EINTR:
-                case EAGAIN:
-                    // do nothing, continue
-                    continue;
-                default:
-                    errstr = strerror(errno);
-                    goto err;
-                }
-            }
-        }
     }
 
-matched:
-    if (inclusive) {
-        lua_pushlstring(L, buf->start, buf->pos - buf->start);
-    } else {
-        lua_pushlstring(L, buf->start, buf->pos - buf->start - len);
-    }
-    buffer_shrink(buf);
+    size_t n = match - buf->pos;
+    lua_pushlstring(L, buf->pos, inclusive ? n + len : n);
+    buffer_consume(buf, n + len);
+    lua_pushinteger(L, 0);
+    lua_replace(L, lua_upvalueindex(4));
     return 1;
 
 err:
     assert(errstr);
     lua_pushnil(L);
     lua_pushstring(L, errstr);
-    lua_pushlstring(L, buf->start, buf->pos - buf->start);
-    buffer_shrink(buf);
+    lua_pushlstring(L, buf->pos, buffer_size(buf));
+    buffer_consume(buf, buffer_size(buf));
+    lua_pushinteger(L, 0);
+    lua_replace(L, lua_upvalueindex(4));
     return 3;
 }
 
+static int
+tcpsock_readuntil_iterator(lua_State *L)
+{
+    struct sockobj *s = lua_touserdata(L, lua_upvalueindex(1));
+    return __sockobj_withdeadline(L, s, __deadline_opt(L, lua_upvalueindex(5)),
+                                  __tcpsock_readuntil_iterator);
+}
+
 /**
- * iterator, err = tcpsock:readuntil(pattern, inclusive?)
+ * iterator, err = tcpsock:readuntil(pattern, inclusive?, deadline?)
+ *
+ * The deadline bounds the reads of the iterator.
  */
 static int
 tcpsock_readuntil(lua_State *L)
 {
-    int n;
+    int n, deadline = 0;
     n = lua_gettop(L);
+    if (n == 4) {
+        luaL_checkudata(L, 4, DEADLINE_TYPENAME);
+        deadline = n--;
+    }
     if (n != 2 && n != 3) {
-        return luaL_error(L, "expecting 2 or 3 arguments (including the object), but got %d", n);
+        return luaL_error(L, "expecting 2 to 4 arguments (including the object), but got %d", n);
     }
     int type = lua_type(L, 2);
     if (type != LUA_TSTRING) {
         return luaL_error(L, "pattern should be string");
     }
+    if (lua_rawlen(L, 2) == 0) {
+        return luaL_error(L, "pattern should not be empty");
+    }
     if (n == 3) {
         if (!lua_isboolean(L, 3)) {
             luaL_error(L, "the second argument should be boolean value");
         }
-    } else {
-        lua_pushboolean(L, 0);
     }
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushboolean(L, n == 3 && lua_toboolean(L, 3));
     lua_pushinteger(L, 0);
+    if (deadline)
+        lua_pushvalue(L, deadline);
+    else
+        lua_pushnil(L);
 
-    lua_pushcclosure(L, tcpsock_readuntil_iterator, 4);
+    lua_pushcclosure(L, tcpsock_readuntil_iterator, 5);
     return 1;
 }
 
@@ -1300,34 +4650,98 @@ tcpsock_shutdown(lua_State * L)
     return 1;
 }
 
+/* Socket options, by name */
+struct sockopt {
+    const char *name;
+    int level;
+    int optname;
+    int boolean;                /* boolean value, integer otherwise */
+};
+
+static const struct sockopt sockopts[] = {
+    {OPT_TCP_NODELAY, IPPROTO_TCP, TCP_NODELAY, 1},
+    {OPT_TCP_KEEPALIVE, SOL_SOCKET, SO_KEEPALIVE, 1},
+    {OPT_TCP_REUSEADDR, SOL_SOCKET, SO_REUSEADDR, 1},
+#if defined(TCP_NOTSENT_LOWAT)
+    {OPT_TCP_NOTSENT_LOWAT, IPPROTO_TCP, TCP_NOTSENT_LOWAT, 0},
+#endif
+#if defined(TCP_USER_TIMEOUT)
+    {OPT_TCP_USER_TIMEOUT, IPPROTO_TCP, TCP_USER_TIMEOUT, 0},
+#endif
+#if defined(TCP_KEEPIDLE)
+    {OPT_TCP_KEEPIDLE, IPPROTO_TCP, TCP_KEEPIDLE, 0},
+#endif
+#if defined(TCP_KEEPINTVL)
+    {OPT_TCP_KEEPINTVL, IPPROTO_TCP, TCP_KEEPINTVL, 0},
+#endif
+#if defined(TCP_KEEPCNT)
+    {OPT_TCP_KEEPCNT, IPPROTO_TCP, TCP_KEEPCNT, 0},
+#endif
+#if defined(TCP_QUICKACK)
+    {OPT_TCP_QUICKACK, IPPROTO_TCP, TCP_QUICKACK, 1},
+#endif
+#if defined(TCP_DEFER_ACCEPT)
+    {OPT_TCP_DEFER_ACCEPT, IPPROTO_TCP, TCP_DEFER_ACCEPT, 0},
+#endif
+    {OPT_SO_SNDBUF, SOL_SOCKET, SO_SNDBUF, 0},
+    {OPT_SO_RCVBUF, SOL_SOCKET, SO_RCVBUF, 0},
+    {OPT_SO_BROADCAST, SOL_SOCKET, SO_BROADCAST, 1},
+#if defined(SO_REUSEPORT)
+    {OPT_SO_REUSEPORT, SOL_SOCKET, SO_REUSEPORT, 1},
+#endif
+#if defined(SO_BUSY_POLL)
+    {OPT_SO_BUSY_POLL, SOL_SOCKET, SO_BUSY_POLL, 0},
+#endif
+#if defined(SO_PRIORITY)
+    {OPT_SO_PRIORITY, SOL_SOCKET, SO_PRIORITY, 0},
+#endif
+    {OPT_IP_TOS, IPPROTO_IP, IP_TOS, 0},
+    {NULL, 0, 0, 0},
+};
+
+static const struct sockopt *
+__sockopt_check(lua_State *L, const char *name)
+{
+    const struct sockopt *o;
+    for (o = sockopts; o->name; o++) {
+        if (!strcmp(o->name, name))
+            return o;
+    }
+    luaL_error(L, "unexpected option: %s", name);
+    return NULL;
+}
+
 /**
- * ok, err = tcpsock:setopt(opt, value)
+ * Set option to value at index idx.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
  */
 static int
-tcpsock_setopt(lua_State * L)
+__sockobj_setopt(lua_State *L, struct sockobj *s, const struct sockopt *o, int idx)
 {
-    struct sockobj *s = getsockobj(L);
-    const char *opt = luaL_checkstring(L, 2);
-    int flag = lua_toboolean(L, 3);
-    socklen_t flagsize;
-    flagsize = sizeof(flag);
-    int err;
-    int level;
-    int optname;
-    if (!strcmp(opt, OPT_TCP_KEEPALIVE)) {
-        level = SOL_SOCKET;
-        optname = SO_KEEPALIVE;
-    } else if (!strcmp(opt, OPT_TCP_NODELAY)) {
-        level = IPPROTO_TCP;
-        optname = TCP_NODELAY;
-    } else if (!strcmp(opt, OPT_TCP_REUSEADDR)) {
-        level = SOL_SOCKET;
-        optname = SO_REUSEADDR;
+    int value;
+    if (o->boolean) {
+        value = lua_toboolean(L, idx);
     } else {
-        return luaL_error(L, "unexpected option: %s", opt);
+        if (!lua_isnumber(L, idx))
+            return luaL_error(L, "option %s expects an integer", o->name);
+        value = lua_tointeger(L, idx);
     }
-    err = setsockopt(s->fd, level, optname, (void *)&flag, flagsize);
-    if (err < 0) {
+    return setsockopt(s->fd, o->level, o->optname, (void *)&value, sizeof(value));
+}
+
+/**
+ * ok, err = sockobj:setopt(opt, value)
+ *
+ * Set a socket option, see sockopts for names. Boolean options take a
+ * boolean, the others an integer.
+ */
+static int
+sockobj_setopt(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    const struct sockopt *o = __sockopt_check(L, luaL_checkstring(L, 2));
+    if (__sockobj_setopt(L, s, o, 3) < 0) {
         lua_pushnil(L);
         lua_pushstring(L, strerror(errno));
         return 2;
@@ -1337,37 +4751,52 @@ tcpsock_setopt(lua_State * L)
 }
 
 /**
- * value, err = tcpsock:getopt(opt)
+ * ok, err = sockobj:setopts({opt = value, ...})
+ *
+ * Set several options at once. Stops at the first failure, with error
+ * message "opt: error".
+ */
+static int
+sockobj_setopts(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+        if (lua_type(L, -2) != LUA_TSTRING)
+            return luaL_error(L, "option names must be strings");
+        const struct sockopt *o = __sockopt_check(L, lua_tostring(L, -2));
+        if (__sockobj_setopt(L, s, o, -1) < 0) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s: %s", o->name, strerror(errno));
+            return 2;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * value, err = sockobj:getopt(opt)
  */
 static int
-tcpsock_getopt(lua_State * L)
+sockobj_getopt(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
-    const char *opt = luaL_checkstring(L, 2);
-    int flag;
-    int err;
-    socklen_t flagsize = sizeof(flag);
-    int level;
-    int optname;
-    if (!strcmp(opt, OPT_TCP_KEEPALIVE)) {
-        level = SOL_SOCKET;
-        optname = SO_KEEPALIVE;
-    } else if (!strcmp(opt, OPT_TCP_NODELAY)) {
-        level = IPPROTO_TCP;
-        optname = TCP_NODELAY;
-    } else if (!strcmp(opt, OPT_TCP_REUSEADDR)) {
-        level = SOL_SOCKET;
-        optname = SO_REUSEADDR;
-    } else {
-        return luaL_error(L, "unexpected option: %s", opt);
-    }
-    err = getsockopt(s->fd, level, optname, (void *)&flag, &flagsize);
-    if (err < 0) {
+    const struct sockopt *o = __sockopt_check(L, luaL_checkstring(L, 2));
+    int value = 0;
+    socklen_t len = sizeof(value);
+    if (getsockopt(s->fd, o->level, o->optname, (void *)&value, &len) < 0) {
         lua_pushnil(L);
         lua_pushstring(L, strerror(errno));
         return 2;
     }
-    lua_pushboolean(L, flag);
+    if (o->boolean)
+        lua_pushboolean(L, value);
+    else
+        lua_pushinteger(L, value);
     return 1;
 }
 
@@ -1451,7 +4880,7 @@ udpsock_connect(lua_State * L)
     if (s->fd > 0) {
         return luaL_error(L, "already connected");
     }
-    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1)) {
+    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1, udpsock_connect)) {
         return 2;
     }
     if (__sockobj_createsocket(L, s, SOCK_DGRAM) == -1) {
@@ -1465,8 +4894,10 @@ udpsock_connect(lua_State * L)
 }
 
 /**
- * ok, err = udpsock:bind(host, port)
+ * ok, err = udpsock:bind(host, port[, opts])
  * ok, err = udpsock:connect("unix:/path/to/unix-domain.sock")
+ *
+ * opts is an optional table of bind options, see __sockobj_bindopts().
  */
 static int
 udpsock_bind(lua_State * L)
@@ -1479,12 +4910,16 @@ udpsock_bind(lua_State * L)
     if (s->fd > 0) {
         return luaL_error(L, "already bound");
     }
-    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1)) {
+    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &len, 1, udpsock_bind)) {
         return 2;
     }
     if (__sockobj_createsocket(L, s, SOCK_DGRAM) == -1) {
         return 2;
     }
+    if (__sockobj_bindopts(L, s, __sockobj_optsarg(L, 1), &errstr) == -1) {
+        __sockobj_close(L, s);
+        goto err;
+    }
     if (bind(s->fd, SAS2SA(&addr), len) < 0) {
         errstr = strerror(errno);
         goto err;
@@ -1502,8 +4937,10 @@ err:
 
 /**
  * ok, err = udpsock:send(data)
+ * ok, err = udpsock:send({data1, data2, ...})
  *
- * Writes data on the current UDP or datagram unix domain socket object.
+ * Writes data on the current UDP or datagram unix domain socket object. A
+ * table of strings is sent as a single datagram.
  *
  * In case of success, it returns true. Otherwise, it returns nil and a string
  * describing the error.
@@ -1512,13 +4949,21 @@ static int
 udpsock_send(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
+    struct iovec stack[IOV_STACKSIZE];
+    struct iovec *iov;
+    int iovcnt;
     size_t len;
-    const char *buf = luaL_checklstring(L, 2, &len);
 
+    iov = __sockobj_checkiov(L, 2, stack, &iovcnt, &len);
+    if (iovcnt > IOV_MAX) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(EMSGSIZE));
+        return 2;
+    }
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm);
     size_t sent = 0;
-    if (__sockobj_send(L, s, buf, len, &sent, &tm) == -1)
+    if (__sockobj_sendmsg(L, s, iov, iovcnt, &sent, NULL, 0, &tm, udpsock_send) == -1)
         return 2;
 
     lua_pushboolean(L, 1);
@@ -1535,16 +4980,34 @@ udpsock_send(lua_State * L)
  * In case of success, it returns true. Otherwise, it returns nil and a string
  * describing the error.
  */
+static int udpsock_sendto_k(lua_State *L);
+
 static int
 udpsock_sendto(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
+    struct iovec stack[IOV_STACKSIZE];
+    struct iovec *iov;
+    int iovcnt;
     size_t len;
-    const char *buf = luaL_checklstring(L, 2, &len);
     sockaddr_t addr;
     socklen_t addrlen;
+    lua_CFunction k = udpsock_sendto;
 
-    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &addrlen, 2)) {
+    // address first, it counts arguments on the stack
+    if (__sockobj_getaddrfromarg(L, s, SAS2SA(&addr), &addrlen, 2, udpsock_sendto)) {
+        return 2;
+    }
+    int top = lua_gettop(L);
+    iov = __sockobj_checkiov(L, 2, stack, &iovcnt, &len);
+    if (lua_gettop(L) > top) {
+        // a large table left its iovec array on the stack, which must be
+        // dropped before the arguments are counted again on resume
+        k = udpsock_sendto_k;
+    }
+    if (iovcnt > IOV_MAX) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(EMSGSIZE));
         return 2;
     }
     if (s->fd == -1) {
@@ -1554,15 +5017,110 @@ udpsock_sendto(lua_State * L)
         }
     }
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm);
     size_t sent = 0;
-    if (__sockobj_sendto(L, s, buf, len, &sent, SAS2SA(&addr), addrlen, &tm) == -1)
+    if (__sockobj_sendmsg(L, s, iov, iovcnt, &sent, SAS2SA(&addr), addrlen, &tm, k) == -1)
         return 2;
 
     lua_pushboolean(L, 1);
     return 1;
 }
 
+/**
+ * Continuation of udpsock:sendto parked with an iovec array on the stack.
+ */
+static int
+udpsock_sendto_k(lua_State *L)
+{
+    lua_pop(L, 1);
+    return udpsock_sendto(L);
+}
+
+/**
+ * count, err = udpsock:sendmany({{data, host, port}, ...})
+ * count, err = udpsock:sendmany({{data, "/path/to/unix-domain.sock"}, ...})
+ * count, err = udpsock:sendmany({{data, addr}, ...})
+ * count, err = udpsock:sendmany({data1, data2, ...})
+ *
+ * Sends a list of datagrams, each either to its own address, or on the
+ * connected socket if it is a plain string, with as few system calls as
+ * possible.
+ *
+ * It returns the number of datagrams sent, and a string describing the error
+ * if not all of them could be sent; the caller may retry with the rest.
+ * If none was sent, it returns nil and the error.
+ */
+static int
+udpsock_sendmany(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    int i, n, batch, sent;
+    int total = 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_rawlen(L, 2);
+
+    struct timeout tm;
+    if (__sockobj_inittimeout(L, s, &tm)) {
+        // resume a send parked by scheduler
+        total = s->wsent;
+    }
+
+    while (total < n) {
+        batch = n - total < MMSG_MAX ? n - total : MMSG_MAX;
+        char *arena = __sockobj_arena(s, batch * (sizeof(mmsghdr_t) +
+                                      sizeof(struct iovec) + sizeof(sockaddr_t)));
+        if (arena == NULL)
+            return luaL_error(L, "out of memory");
+        mmsghdr_t *msgs = (mmsghdr_t *)arena;
+        struct iovec *iov = (struct iovec *)(msgs + batch);
+        sockaddr_t *addrs = (sockaddr_t *)(iov + batch);
+
+        memset(msgs, 0, batch * sizeof(mmsghdr_t));
+        for (i = 0; i < batch; i++) {
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            lua_rawgeti(L, 2, total + i + 1);
+            if (lua_istable(L, -1)) {
+                socklen_t addrlen;
+                if (__sockobj_getaddrfromtable(L, s, -1, 2, SAS2SA(&addrs[i]), &addrlen) == -1)
+                    goto err;
+                msgs[i].msg_hdr.msg_name = &addrs[i];
+                msgs[i].msg_hdr.msg_namelen = addrlen;
+                lua_rawgeti(L, -1, 1);
+                lua_replace(L, -2);
+            }
+            // strings only, as in __sockobj_checkiov
+            if (lua_type(L, -1) != LUA_TSTRING)
+                return luaL_error(L, "bad datagram at index %d (string expected, got %s)",
+                                  total + i + 1, luaL_typename(L, -1));
+            // the string is still referenced by the list
+            iov[i].iov_base = (void *)lua_tolstring(L, -1, &iov[i].iov_len);
+            lua_pop(L, 1);
+        }
+
+        if (s->fd == -1 && s->sock_family != 0) {
+            // create socket if not presented
+            if (__sockobj_createsocket(L, s, SOCK_DGRAM) == -1)
+                goto err;
+        }
+        s->wsent = total;
+        if (__sockobj_sendmany(L, s, msgs, batch, &sent, &tm, udpsock_sendmany) == -1)
+            goto err;
+        total += sent;
+    }
+
+    lua_pushinteger(L, total);
+    return 1;
+
+err:
+    // nil and error message are on the stack
+    if (total > 0) {
+        lua_pushinteger(L, total);
+        lua_replace(L, -3);
+    }
+    return 2;
+}
+
 /**
  * data, err = udpsock:recv(buffersize)
  *
@@ -1577,34 +5135,40 @@ udpsock_recv(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
     size_t buffersize = (int)luaL_checknumber(L, 2);
-    struct buffer *buf = NULL;
-    buf = buffer_create(buffersize);
+    char *buf = __sockobj_arena(s, buffersize);
     size_t received = 0;
+    if (buf == NULL)
+        return luaL_error(L, "out of memory");
 
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm);
 
-    if (__sockobj_recv(L, s, buf->last, buffersize, &received, &tm) == -1)
+    if (__sockobj_recv(L, s, buf, buffersize, &received, &tm, udpsock_recv) == -1)
         return 2;
 
-    lua_pushlstring(L, buf->last, received);
+    lua_pushlstring(L, buf, received);
     return 1;
 }
 
 /**
  * data, addr, err = udpsock:recvfrom(buffersize)
+ * data, addr, err = udpsock:recvfrom(buffersize, true)
  *
  * Works exactly as the udpsock:recv method, except it returns the addr as extra
  * return values (and is therefore slightly less efficient) in
  * case of success.
+ *
+ * If the second argument is true, addr is an address object instead of a
+ * table, which is cheaper: it is interned, so it can be compared or used as a
+ * table key, and given to udpsock:sendto to reply.
  */
 static int
 udpsock_recvfrom(lua_State * L)
 {
     struct sockobj *s = getsockobj(L);
     size_t buffersize = (int)luaL_checknumber(L, 2);
-    struct buffer *buf = NULL;
-    buf = buffer_create(buffersize);
+    char *buf = __sockobj_arena(s, buffersize);
+    int asobject = lua_toboolean(L, 3);
     size_t received = 0;
     sockaddr_t addr;
     socklen_t addrlen;
@@ -1614,14 +5178,20 @@ udpsock_recvfrom(lua_State * L)
         lua_pushstring(L, "unknown address family");
         return 2;
     }
+    if (buf == NULL)
+        return luaL_error(L, "out of memory");
 
     struct timeout tm;
-    timeout_init(&tm, s->sock_timeout);
+    __sockobj_inittimeout(L, s, &tm);
 
-    if (__sockobj_recvfrom(L, s, buf->last, buffersize, &received, SAS2SA(&addr), &addrlen, &tm) == -1)
+    if (__sockobj_recvfrom(L, s, buf, buffersize, &received, SAS2SA(&addr), &addrlen, &tm, udpsock_recvfrom) == -1)
         return 2;
 
-    lua_pushlstring(L, buf->last, received);
+    lua_pushlstring(L, buf, received);
+    if (asobject) {
+        __addrobj_push(L, SAS2SA(&addr), addrlen);
+        return 2;
+    }
     if (__sockobj_makeaddr(L, s, SAS2SA(&addr), addrlen) == -1) {
         lua_pop(L, 1);
         return 2;
@@ -1630,10 +5200,363 @@ udpsock_recvfrom(lua_State * L)
     return 2;
 }
 
+/**
+ * datas, err = udpsock:recvmany(n, buffersize)
+ * datas, addrs, err = udpsock:recvmany(n, buffersize, true)
+ *
+ * Receive up to n datagrams of at most buffersize bytes each, with a single
+ * system call if possible. It waits for the first datagram only, and returns
+ * an array of the datagrams available then. If the third argument is true,
+ * an array of their addresses (address objects) is returned as well.
+ *
+ * In case of error, it returns nil with a string describing the error.
+ */
+static int
+udpsock_recvmany(lua_State * L)
+{
+    struct sockobj *s = getsockobj(L);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    lua_Integer buffersize = luaL_checkinteger(L, 3);
+    int withaddr = lua_toboolean(L, 4);
+    int i, received = 0;
+    socklen_t addrlen = sizeof(sockaddr_t);
+    luaL_argcheck(L, n > 0 && n <= MMSG_MAX, 2, "out of range");
+    luaL_argcheck(L, buffersize > 0 && buffersize <= DGRAM_MAXSIZE, 3, "out of range");
+
+    // Arena layout: n headers, n iovecs, n addresses, then payloads.
+    size_t hdrsize = n * (sizeof(mmsghdr_t) + sizeof(struct iovec) + sizeof(sockaddr_t));
+    char *arena = __sockobj_arena(s, hdrsize + n * buffersize);
+    if (arena == NULL) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(ENOMEM));
+        return 2;
+    }
+    mmsghdr_t *msgs = (mmsghdr_t *)arena;
+    struct iovec *iov = (struct iovec *)(msgs + n);
+    sockaddr_t *addrs = (sockaddr_t *)(iov + n);
+    char *payload = arena + hdrsize;
+
+    memset(msgs, 0, n * sizeof(mmsghdr_t));
+    for (i = 0; i < n; i++) {
+        iov[i].iov_base = payload + i * buffersize;
+        iov[i].iov_len = buffersize;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (withaddr) {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = addrlen;
+        }
+    }
+
+    struct timeout tm;
+    __sockobj_inittimeout(L, s, &tm);
+
+    if (__sockobj_recvmany(L, s, msgs, n, &received, &tm, udpsock_recvmany) == -1)
+        return 2;
+
+    lua_createtable(L, received, 0);
+    for (i = 0; i < received; i++) {
+        lua_pushlstring(L, iov[i].iov_base, msgs[i].msg_len);
+        lua_rawseti(L, -2, i + 1);
+    }
+    if (!withaddr)
+        return 1;
+
+    lua_createtable(L, received, 0);
+    for (i = 0; i < received; i++) {
+        __addrobj_push(L, SAS2SA(&addrs[i]), msgs[i].msg_hdr.msg_namelen);
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 2;
+}
+
+/**
+ * Check whether the function argument idx is a tcp or udp socket object.
+ */
+static struct sockobj *
+__checksockobj(lua_State *L, int idx)
+{
+    struct sockobj *s = luaL_testudata(L, idx, TCPSOCK_TYPENAME);
+    if (!s)
+        s = luaL_testudata(L, idx, UDPSOCK_TYPENAME);
+    if (!s)
+        luaL_argerror(L, idx, "socket object expected");
+    return s;
+}
+
+/**
+ * Parse poller events string: 'r' for readable, 'w' for writable, 'e' for
+ * edge-triggered notification, 'x' for exclusive wakeup.
+ */
+static int
+__pollerobj_checkevents(lua_State *L, int idx)
+{
+    const char *str = luaL_checkstring(L, idx);
+    int events = 0;
+    for (; *str; str++) {
+        switch (*str) {
+        case 'r':
+            events |= POLLER_READ;
+            break;
+        case 'w':
+            events |= POLLER_WRITE;
+            break;
+        case 'e':
+            events |= POLLER_EDGE;
+            break;
+        case 'x':
+            events |= POLLER_EXCLUSIVE;
+            break;
+        default:
+            luaL_argerror(L, idx, "invalid events, expecting 'r', 'w', 'e' or 'x'");
+        }
+    }
+    if (!(events & (POLLER_READ | POLLER_WRITE))) {
+        luaL_argerror(L, idx, "expecting 'r' or 'w' event");
+    }
+    return events;
+}
+
+static struct pollerobj *
+__checkpollerobj(lua_State *L)
+{
+    struct pollerobj *p = luaL_checkudata(L, 1, POLLER_TYPENAME);
+    if (!p->poller) {
+        luaL_error(L, "attempt to use a closed poller");
+    }
+    return p;
+}
+
+/**
+ * ok, err = poller:add(sock, events)
+ *
+ * Register a socket object. `events` is a string made of 'r' (readable), 'w'
+ * (writable) and optionally 'e' (edge-triggered, level-triggered by default)
+ * and 'x' (exclusive: when processes poll a shared listener, only one of them
+ * is woken, EPOLLEXCLUSIVE; cannot be modified afterwards).
+ */
+static int
+pollerobj_add(lua_State *L)
+{
+    struct pollerobj *p = __checkpollerobj(L);
+    struct sockobj *s = __checksockobj(L, 2);
+    int events = __pollerobj_checkevents(L, 3);
+
+    if (s->fd == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, ERROR_CLOSED);
+        return 2;
+    }
+    if (poller_add(p->poller, s->fd, events, s) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+
+    lua_getuservalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_rawsetp(L, -2, s);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * ok, err = poller:modify(sock, events)
+ *
+ * Change the events of a registered socket object.
+ */
+static int
+pollerobj_modify(lua_State *L)
+{
+    struct pollerobj *p = __checkpollerobj(L);
+    struct sockobj *s = __checksockobj(L, 2);
+    int events = __pollerobj_checkevents(L, 3);
+
+    if (s->fd == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, ERROR_CLOSED);
+        return 2;
+    }
+    if (poller_mod(p->poller, s->fd, events, s) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * ok, err = poller:remove(sock)
+ *
+ * Unregister a socket object. Sockets should be removed before they are
+ * closed, or the poller keeps a reference to them.
+ */
+static int
+pollerobj_remove(lua_State *L)
+{
+    struct pollerobj *p = __checkpollerobj(L);
+    struct sockobj *s = __checksockobj(L, 2);
+
+    lua_getuservalue(L, 1);
+    lua_pushnil(L);
+    lua_rawsetp(L, -2, s);
+
+    // closed fds were already dropped by the kernel
+    if (s->fd != -1 && poller_del(p->poller, s->fd) == -1) {
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/**
+ * readable, writable, err = poller:wait([timeout=-1[, max=64]])
+ *
+ * Wait for registered sockets to become ready, and return at most `max` of
+ * them as two tables of socket objects. A zero timeout checks for readiness
+ * without blocking.
+ */
+static int
+pollerobj_wait(lua_State *L)
+{
+    struct pollerobj *p = __checkpollerobj(L);
+    double timeout = luaL_optnumber(L, 2, -1);
+    int max = luaL_optint(L, 3, POLLER_MAXEVENTS);
+    int i, n, nr = 0, nw = 0;
+
+    luaL_argcheck(L, max > 0, 3, "should be positive");
+    if (max > p->nevents) {
+        struct poller_event *events = realloc(p->events, max * sizeof(*events));
+        if (!events) {
+            return luaL_error(L, "out of memory");
+        }
+        p->events = events;
+        p->nevents = max;
+    }
+
+    n = poller_wait(p->poller, p->events, max, timeout);
+    if (n < 0) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushstring(L, strerror(errno));
+        return 3;
+    } else if (n == 0) {
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushstring(L, ERROR_TIMEOUT);
+        return 3;
+    }
+
+    lua_getuservalue(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    for (i = 0; i < n; i++) {
+        lua_rawgetp(L, -3, p->events[i].ud);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        if (p->events[i].events & POLLER_READ) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -4, ++nr);
+        }
+        if (p->events[i].events & POLLER_WRITE) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, ++nw);
+        }
+        lua_pop(L, 1);
+    }
+    return 2;
+}
+
+/**
+ * poller:close()
+ *
+ * Release the poller and all its references to socket objects.
+ */
+static int
+pollerobj_close(lua_State *L)
+{
+    struct pollerobj *p = luaL_checkudata(L, 1, POLLER_TYPENAME);
+    if (p->poller) {
+        poller_delete(p->poller);
+        p->poller = NULL;
+    }
+    if (p->events) {
+        free(p->events);
+        p->events = NULL;
+        p->nevents = 0;
+    }
+    lua_newtable(L);
+    lua_setuservalue(L, 1);
+    return 0;
+}
+
+/**
+ * host, port = addr:unpack()
+ * path = addr:unpack()
+ */
+static int
+addrobj_unpack(lua_State *L)
+{
+    struct addrobj *a = luaL_checkudata(L, 1, ADDRESS_TYPENAME);
+    char buf[INET_ADDRSTRLEN];
+
+    switch (a->addr.sa.sa_family) {
+    case AF_INET:
+        inet_ntop(AF_INET, &a->addr.in.sin_addr, buf, sizeof(buf));
+        lua_pushstring(L, buf);
+        lua_pushinteger(L, ntohs(a->addr.in.sin_port));
+        return 2;
+    case AF_UNIX:
+        if (a->addrlen <= offsetof(struct sockaddr_un, sun_path)) {
+            /* unnamed socket */
+            lua_pushliteral(L, "");
+        } else {
+            lua_pushstring(L, a->addr.un.sun_path);
+        }
+        return 1;
+    default:
+        lua_pushnil(L);
+        lua_pushstring(L, "unknown address family");
+        return 2;
+    }
+}
+
+static int
+addrobj_tostring(lua_State *L)
+{
+    struct addrobj *a = luaL_checkudata(L, 1, ADDRESS_TYPENAME);
+    int n = addrobj_unpack(L);
+    if (a->addr.sa.sa_family == AF_INET && n == 2)
+        lua_pushfstring(L, "<address: %s:%d>", lua_tostring(L, -2), (int)lua_tointeger(L, -1));
+    else if (n == 1)
+        lua_pushfstring(L, "<address: %s>", lua_tostring(L, -1));
+    else
+        lua_pushliteral(L, "<address>");
+    return 1;
+}
+
 static const luaL_Reg socketlib[] = {
     {"tcp", socket_tcp},
     {"udp", socket_udp},
     {"select", socket_select},
+    {"poller", socket_poller},
+    {"address", socket_address},
+    {"splice", socket_splice},
+    {"connect_all", socket_connect_all},
+    {"fork_workers", socket_fork_workers},
+    {"spawn", socket_spawn},
+    {"timer", socket_timer},
+    {"deadline", socket_deadline},
+    {"sleep", socket_sleep},
+    {"run", socket_run},
+    {"stats", socket_stats},
+    {"bufstats", socket_bufstats},
+    {"setresolver", socket_setresolver},
     {NULL, NULL},
 };
 
@@ -1644,20 +5567,30 @@ static const luaL_Reg sockobj_methods[] = {
     {"fileno", sockobj_fileno},
     {"settimeout", sockobj_settimeout},
     {"gettimeout", sockobj_gettimeout},
+    {"setdeadline", sockobj_setdeadline},
+    {"setopt", sockobj_setopt},
+    {"setopts", sockobj_setopts},
+    {"getopt", sockobj_getopt},
     {NULL, NULL},
 };
 
 static const luaL_Reg tcpsock_methods[] = {
     {"connect", tcpsock_connect},
+    {"connect_start", tcpsock_connect_start},
     {"bind", tcpsock_bind},
     {"listen", tcpsock_listen},
     {"accept", tcpsock_accept},
+    {"acceptmany", tcpsock_acceptmany},
     {"write", tcpsock_write},
+    {"flush", tcpsock_flush},
+    {"setwritebuffer", tcpsock_setwritebuffer},
+    {"setreadbuffer", tcpsock_setreadbuffer},
+    {"sendfile", tcpsock_sendfile},
+    {"copyto", tcpsock_copyto},
     {"read", tcpsock_read},
     {"readuntil", tcpsock_readuntil},
     {"shutdown", tcpsock_shutdown},
-    {"setopt", tcpsock_setopt},
-    {"getopt", tcpsock_getopt},
+    {"setkeepalive", tcpsock_setkeepalive},
     {"getpeername", tcpsock_getpeername},
     {"getsockname", tcpsock_getsockname},
     {NULL, NULL},
@@ -1668,14 +5601,46 @@ static const luaL_Reg udpsock_methods[] = {
     {"bind", udpsock_bind},
     {"send", udpsock_send},
     {"sendto", udpsock_sendto},
+    {"sendmany", udpsock_sendmany},
     {"recv", udpsock_recv},
     {"recvfrom", udpsock_recvfrom},
+    {"recvmany", udpsock_recvmany},
+    {NULL, NULL},
+};
+
+static const luaL_Reg addrobj_methods[] = {
+    {"__tostring", addrobj_tostring},
+    {"unpack", addrobj_unpack},
+    {NULL, NULL},
+};
+
+static const luaL_Reg deadlineobj_methods[] = {
+    {"left", deadlineobj_left},
+    {"expired", deadlineobj_expired},
+    {NULL, NULL},
+};
+
+static const luaL_Reg timerobj_methods[] = {
+    {"__gc", timerobj_gc},
+    {"cancel", timerobj_cancel},
+    {NULL, NULL},
+};
+
+static const luaL_Reg pollerobj_methods[] = {
+    {"__gc", pollerobj_close},
+    {"add", pollerobj_add},
+    {"modify", pollerobj_modify},
+    {"remove", pollerobj_remove},
+    {"wait", pollerobj_wait},
+    {"close", pollerobj_close},
     {NULL, NULL},
 };
 
 int
 luaopen_ssocket(lua_State * L)
 {
+    const struct sockopt *opt;
+
     luaL_checkversion(L);
     luaL_newlib(L, socketlib);
 
@@ -1690,10 +5655,16 @@ luaopen_ssocket(lua_State * L)
     // Module infos:
     ADD_STR_CONST(_VERSION);
 
-    // OPT_* options
-    ADD_STR_CONST(OPT_TCP_NODELAY);
-    ADD_STR_CONST(OPT_TCP_KEEPALIVE);
-    ADD_STR_CONST(OPT_TCP_REUSEADDR);
+    // OPT_* options, only the ones supported by the platform
+    for (opt = sockopts; opt->name; opt++) {
+        char name[64] = "OPT_";
+        size_t i;
+        for (i = 0; opt->name[i] && i < sizeof(name) - 5; i++)
+            name[i + 4] = toupper((unsigned char)opt->name[i]);
+        name[i + 4] = '\0';
+        lua_pushstring(L, opt->name);
+        lua_setfield(L, -2, name);
+    }
 
     // SHUT_* sock:shutdown() parameters
     ADD_NUM_CONST(SHUT_RD);
@@ -1721,6 +5692,40 @@ luaopen_ssocket(lua_State * L)
     luaL_setfuncs(L, udpsock_methods, 0);
     lua_pop(L, 1);
 
+    // Create a metatable for address userdata.
+    luaL_newmetatable(L, ADDRESS_TYPENAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");     /* metable.__index = metatable */
+    luaL_setfuncs(L, addrobj_methods, 0);
+    lua_pop(L, 1);
+
+    // Create a metatable for poller userdata.
+    luaL_newmetatable(L, POLLER_TYPENAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");     /* metable.__index = metatable */
+    luaL_setfuncs(L, pollerobj_methods, 0);
+    lua_pop(L, 1);
+
+    // Create a metatable for deadline userdata.
+    luaL_newmetatable(L, DEADLINE_TYPENAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");     /* metable.__index = metatable */
+    luaL_setfuncs(L, deadlineobj_methods, 0);
+    lua_pop(L, 1);
+
+    // Create a metatable for timer userdata.
+    luaL_newmetatable(L, TIMER_TYPENAME);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");     /* metable.__index = metatable */
+    luaL_setfuncs(L, timerobj_methods, 0);
+    lua_pop(L, 1);
+
+    // Create a metatable for scheduler userdata.
+    luaL_newmetatable(L, SCHED_TYPENAME);
+    lua_pushcfunction(L, sched_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     // install a handler to ignore sigpipe or it will crash us
     signal(SIGPIPE, SIG_IGN);
 
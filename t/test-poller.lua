@@ -0,0 +1,55 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+
+require 'Test.More'
+local socket = require "ssocket"
+
+plan(13)
+
+local port = 16790
+
+local listener = socket.tcp()
+is(listener:bind("127.0.0.1", port), true)
+is(listener:listen(16), true)
+
+local poller = socket.poller()
+is(poller:add(listener, "r"), true)
+
+-- 1. Timeout
+local readable, writable, err = poller:wait(0)
+is(err, socket.ERROR_TIMEOUT)
+
+-- 2. Listener becomes readable
+local client = socket.tcp()
+is(client:connect("127.0.0.1", port), true)
+readable, writable, err = poller:wait(1)
+is(readable[1], listener)
+local conn = listener:accept()
+ok(conn)
+
+-- 3. Only ready sockets are returned
+is(poller:add(conn, "r"), true)
+client:write("ping")
+readable, writable, err = poller:wait(1)
+is(#readable, 1)
+is(readable[1], conn)
+is(conn:read(4), "ping")
+
+-- 4. Writable
+is(poller:modify(conn, "rw"), true)
+readable, writable, err = poller:wait(1)
+is(writable[1], conn)
+
+-- 5. Remove
+poller:remove(conn)
+poller:remove(listener)
+readable, writable, err = poller:wait(0)
+is(err, socket.ERROR_TIMEOUT)
+
+poller:close()
+conn:close()
+client:close()
+listener:close()
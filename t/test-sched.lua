@@ -0,0 +1,452 @@
+-- setup path
+local filepath = debug.getinfo(1).source:match("@(.*)$")
+local filedir = filepath:match('(.+)/[^/]*') or '.'
+package.path = string.format(";%s/?.lua;%s/../?.lua;", filedir, filedir) .. package.path
+package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. package.cpath
+
+require 'Test.More'
+local socket = require "ssocket"
+
+plan(71)
+
+local port = 16791
+local nclients = 10
+
+-- 1. Echo server and clients in managed coroutines
+local listener = socket.tcp()
+is(listener:bind("127.0.0.1", port), true)
+is(listener:listen(nclients), true)
+
+socket.spawn(function ()
+  for i = 1, nclients do
+    local conn = listener:accept()
+    socket.spawn(function ()
+      local reader = conn:readuntil("\n", true)
+      local line = reader()
+      conn:write(line)
+      conn:close()
+    end)
+  end
+  listener:close()
+end)
+
+local replies = {}
+for i = 1, nclients do
+  socket.spawn(function (i)
+    local sock = socket.tcp()
+    sock:connect("127.0.0.1", port)
+    sock:write("hello " .. i .. "\n")
+    local reader = sock:readuntil("\n")
+    replies[i] = reader()
+    sock:close()
+  end, i)
+end
+
+local stats = socket.stats()
+local ok, err = socket.run()
+is(ok, true)
+is(err, nil)
+is(#replies, nclients)
+is(replies[nclients], "hello " .. nclients)
+cmp_ok(socket.stats().io_fast, '>', stats.io_fast, "writes completed without waiting")
+cmp_ok(socket.stats().io_waits, '>', stats.io_waits, "reads waited for data")
+like(stats.poller, "^[%w_]+$", "scheduler poller backend")
+
+-- 2. Timeout while parked
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 1)
+listener:listen(1)
+listener:settimeout(0.05)
+local result
+socket.spawn(function ()
+  local conn, err = listener:accept()
+  result = err
+end)
+is(socket.run(), true)
+is(result, socket.ERROR_TIMEOUT)
+listener:close()
+
+-- 3. Errors are reported by socket.run()
+socket.spawn(function () error("boom") end)
+local ok, err = socket.run()
+is(ok, nil)
+like(err, "boom")
+
+-- 4. Vectored writes, large enough to be written partially
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 2)
+listener:listen(1)
+local chunks = {}
+for i = 1, 100 do
+  chunks[i] = string.rep(string.char(64 + i % 26), 10000)
+end
+local expected = table.concat(chunks)
+local received
+socket.spawn(function ()
+  local conn = listener:accept()
+  received = conn:read(#expected)
+  conn:close()
+end)
+local written
+socket.spawn(function ()
+  local sock = socket.tcp()
+  sock:connect("127.0.0.1", port + 2)
+  written = sock:write(chunks)
+  sock:close()
+end)
+is(socket.run(), true)
+is(written, #expected)
+is(received, expected)
+listener:close()
+
+-- 5. Buffered writes
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 3)
+listener:listen(1)
+local received
+socket.spawn(function ()
+  local conn = listener:accept()
+  received = conn:read(3 * 100)
+  conn:close()
+end)
+local wstats
+socket.spawn(function ()
+  local sock = socket.tcp()
+  sock:connect("127.0.0.1", port + 3)
+  sock:setwritebuffer(4096)
+  local before = socket.stats().io_fast
+  for i = 1, 100 do
+    sock:write(string.format("%03d", i))
+  end
+  wstats = socket.stats().io_fast - before
+  sock:flush()
+  sock:close()
+end)
+is(socket.run(), true)
+is(wstats, 0, "writes kept in buffer until flush")
+is(#received, 300)
+like(received, "^001002003.*100$")
+listener:close()
+
+-- 6. readuntil with a self-overlapping pattern split across packets
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 4)
+listener:listen(1)
+local lines = {}
+socket.spawn(function ()
+  local conn = listener:accept()
+  local reader = conn:readuntil("aab")
+  lines[1] = reader()
+  lines[2] = reader()
+  conn:close()
+end)
+socket.spawn(function ()
+  local sock = socket.tcp()
+  sock:connect("127.0.0.1", port + 4)
+  sock:write("xaa")
+  socket.spawn(function ()
+    sock:write("abyaaaab")
+    sock:close()
+  end)
+end)
+is(socket.run(), true)
+is(lines[1], "xa")
+is(lines[2], "yaa")
+listener:close()
+
+-- 7. Buffers are given back to pool once drained
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 5)
+listener:listen(1)
+local line
+socket.spawn(function ()
+  local conn = listener:accept()
+  local reader = conn:readuntil("\n")
+  reader()
+  line = reader()
+  conn:close()
+end)
+socket.spawn(function ()
+  local sock = socket.tcp()
+  sock:connect("127.0.0.1", port + 5)
+  sock:write("one\n")
+  sock:write("two\n")
+  sock:close()
+end)
+is(socket.run(), true)
+is(line, "two")
+is(socket.bufstats().used_bytes, 0)
+listener:close()
+
+-- 8. sendfile
+local path = os.tmpname()
+local f = io.open(path, "w")
+f:write(string.rep("0123456789", 100000))
+f:close()
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 6)
+listener:listen(1)
+local received
+socket.spawn(function ()
+  local conn = listener:accept()
+  received = conn:read(999990)
+  conn:close()
+end)
+local sent
+socket.spawn(function ()
+  local sock = socket.tcp()
+  sock:connect("127.0.0.1", port + 6)
+  sent = sock:sendfile(path, 10)
+  sock:close()
+end)
+is(socket.run(), true)
+is(sent, 999990)
+is(received, string.rep("0123456789", 99999))
+listener:close()
+os.remove(path)
+
+-- 9. splice between sockets
+local l1, l2 = socket.tcp(), socket.tcp()
+l1:bind("127.0.0.1", port + 7)
+l1:listen(1)
+l2:bind("127.0.0.1", port + 8)
+l2:listen(1)
+local relayed, moved, spliceerr = {}, 0
+socket.spawn(function ()
+  local a1 = l1:accept()
+  local c2 = socket.tcp()
+  c2:connect("127.0.0.1", port + 8)
+  while true do
+    local n, err = socket.splice(a1, c2)
+    if not n then spliceerr = err break end
+    moved = moved + n
+  end
+  a1:close()
+  c2:close()
+end)
+socket.spawn(function ()
+  local a2 = l2:accept()
+  local reader = a2:readuntil("\n")
+  relayed[1] = reader()
+  relayed[2] = reader()
+  a2:close()
+end)
+socket.spawn(function ()
+  local c1 = socket.tcp()
+  c1:connect("127.0.0.1", port + 7)
+  c1:write("first\nsecond\n")
+  c1:close()
+end)
+is(socket.run(), true)
+is(relayed[2], "second")
+is(moved, 13)
+is(spliceerr, socket.ERROR_CLOSED)
+local path = os.tmpname()
+local file = io.open(path, "w")
+local copied, copyerr = 0
+socket.spawn(function ()
+  local a1 = l1:accept()
+  while true do
+    local n, err = a1:copyto(file)
+    if not n then copyerr = err break end
+    copied = copied + n
+  end
+  a1:close()
+end)
+socket.spawn(function ()
+  local c1 = socket.tcp()
+  c1:connect("127.0.0.1", port + 7)
+  c1:write("to a file\n")
+  c1:close()
+end)
+is(socket.run(), true)
+file:close()
+is(io.open(path):read("*a"), "to a file\n")
+is(copied, 10)
+is(copyerr, socket.ERROR_CLOSED)
+os.remove(path)
+l1:close()
+l2:close()
+
+-- 10. Host names resolved by worker threads, and cached
+local listener = socket.tcp()
+listener:bind("localhost", port + 9)
+listener:listen(2)
+socket.setresolver({ttl = 60, negative_ttl = 60})
+local dns = socket.stats()
+local accepted, connected = 0, {}
+socket.spawn(function ()
+  for i = 1, 2 do
+    local conn = listener:accept()
+    accepted = accepted + 1
+    conn:close()
+  end
+end)
+socket.spawn(function ()
+  for i = 1, 2 do
+    local sock = socket.tcp()
+    connected[i] = sock:connect("localhost", port + 9)
+    sock:close()
+  end
+end)
+is(socket.run(), true)
+is(accepted, 2)
+is(connected[2], true)
+cmp_ok(socket.stats().dns_hits, '>', dns.dns_hits, "second lookup found in cache")
+local addr, err = socket.address("nonexistent.invalid", 80)
+is(addr, nil)
+local misses = socket.stats().dns_misses
+is(select(2, socket.address("nonexistent.invalid", 80)) == err and
+   socket.stats().dns_misses == misses, true, "failure cached")
+listener:close()
+
+-- 11. Parallel connects
+local listeners, socks = {}, {}
+for i = 1, 3 do
+  listeners[i] = socket.tcp()
+  listeners[i]:bind("127.0.0.1", port + 10 + i)
+  listeners[i]:listen(4)
+end
+for i = 1, 4 do
+  socks[i] = socket.tcp()
+  socks[i]:connect_start("127.0.0.1", port + 10 + i)
+end
+local results, n = socket.connect_all(socks, 1)
+is(n, 3)
+is(results[3], true)
+like(results[4], "refused")
+local nany
+socket.spawn(function ()
+  local socks = {}
+  for i = 1, 3 do
+    socks[i] = socket.tcp()
+    socks[i]:connect_start("127.0.0.1", port + 10 + i)
+  end
+  local results
+  results, nany = socket.connect_all(socks, 1, "any")
+  for i = 1, 3 do
+    socks[i]:close()
+  end
+end)
+is(socket.run(), true)
+cmp_ok(nany, '>=', 1, "returned once one is connected")
+local late = socket.tcp()
+late:connect_start("127.0.0.1", port + 11)
+results, n = socket.connect_all({socks[1], late}, 1, "any")
+is(n, 1, "already connected socket not counted")
+is(results[1], true)
+is(results[2], true, "waited for the pending one")
+late:close()
+for i = 1, 3 do
+  socks[i]:close()
+  listeners[i]:close()
+end
+
+-- 12. TCP Fast Open over loopback, data in SYN needs net.ipv4.tcp_fastopen=3
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 16)
+is(listener:listen(8, {fastopen = 8}), true)
+local tfo = socket.stats()
+local requests = {}
+socket.spawn(function ()
+  for i = 1, 2 do
+    local conn = listener:accept()
+    requests[i] = conn:readuntil("\n")()
+    conn:close()
+  end
+end)
+socket.spawn(function ()
+  for i = 1, 2 do
+    local sock = socket.tcp()
+    sock:connect("127.0.0.1", port + 16, {fastopen = "req" .. i .. "\n"})
+    sock:close()
+  end
+end)
+is(socket.run(), true)
+is(requests[1] .. requests[2], "req1req2")
+local stats = socket.stats()
+is(stats.tfo_connects - tfo.tfo_connects, 2)
+cmp_ok(stats.tfo_syn_acked - tfo.tfo_syn_acked, '<=',
+       stats.tfo_syn_data - tfo.tfo_syn_data, "cookie path counted")
+listener:close()
+
+-- 13. Timers and sleep
+local fired = {}
+local t1 = socket.timer(0.02, function (name) fired[#fired + 1] = name end, "late")
+socket.timer(0.005, function (name) fired[#fired + 1] = name end, "early")
+local t3 = socket.timer(0.01, function () fired[#fired + 1] = "cancelled" end)
+is(t3:cancel(), true)
+local slept
+socket.spawn(function ()
+  socket.sleep(0.0005)
+  fired[#fired + 1] = "sleep"
+  socket.sleep(0.01)
+  slept = true
+end)
+is(socket.run(), true)
+is(table.concat(fired, " "), "sleep early late")
+is(slept, true)
+is(t1:cancel(), false, "fired timer cannot be cancelled")
+
+-- 14. A deadline shared by several operations
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 17)
+listener:listen(1)
+socket.spawn(function ()
+  local conn = listener:accept()
+  conn:write("a")
+  socket.sleep(0.03)
+  conn:write("b")
+  socket.sleep(0.03)
+  conn:write("c")
+  conn:close()
+end)
+local got, err, expired, after = {}
+socket.spawn(function ()
+  local sock = socket.tcp()
+  sock:settimeout(1)
+  local deadline = socket.deadline(0.05)
+  sock:connect("127.0.0.1", port + 17, {deadline = deadline})
+  for i = 1, 3 do
+    got[i], err = sock:read(1, deadline)
+    if not got[i] then break end
+  end
+  expired = deadline:expired()
+  after = sock:read(1)
+  sock:close()
+end)
+is(socket.run(), true)
+is(table.concat(got), "ab")
+is(err, socket.ERROR_TIMEOUT, "third read cut short by deadline")
+is(expired, true)
+is(after, "c", "deadline not kept by the socket")
+listener:close()
+
+-- 15. A buffered write crossing the watermark parks partway and resumes
+local listener = socket.tcp()
+listener:bind("127.0.0.1", port + 18)
+listener:listen(1)
+local head, body = "head", string.rep("0123456789abcdef", 256 * 1024)
+local received
+socket.spawn(function ()
+  local conn = listener:accept()
+  socket.sleep(0.05)
+  received = conn:read(#head + #body)
+  conn:close()
+end)
+local wok, fok
+socket.spawn(function ()
+  local sock = socket.tcp()
+  sock:connect("127.0.0.1", port + 18)
+  sock:setwritebuffer(4096)
+  sock:write(head)
+  wok = sock:write(body)
+  fok = sock:flush()
+  sock:close()
+end)
+is(socket.run(), true)
+isnt(wok, nil)
+isnt(fok, nil)
+is(received and #received, #head + #body, "nothing sent twice")
+is(received == head .. body, true)
+listener:close()
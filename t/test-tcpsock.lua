@@ -7,7 +7,29 @@ package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. packa
 require 'Test.More'
 local socket = require "ssocket"
 
-plan(29)
+plan(63)
+
+-- Run server(conn) and client(sock) on both ends of a local connection, in
+-- managed coroutines. Returns the result of socket.run().
+local function connected(port, server, client)
+  local listener = socket.tcp()
+  listener:bind("127.0.0.1", port)
+  listener:listen(1)
+  socket.spawn(function ()
+    local conn = listener:accept()
+    server(conn)
+    conn:close()
+  end)
+  socket.spawn(function ()
+    local sock = socket.tcp()
+    sock:connect("127.0.0.1", port)
+    client(sock)
+    sock:close()
+  end)
+  local ok, err = socket.run()
+  listener:close()
+  return ok, err
+end
 
 -- 1. Success connection.
 local tcpsock, err = socket.tcp()
@@ -73,3 +95,121 @@ local value = tcpsock:getopt(socket.OPT_TCP_NODELAY)
 is(value, true)
 local value = tcpsock:getopt(socket.OPT_TCP_REUSEADDR)
 is(value, true)
+ok, err = tcpsock:setopts({so_sndbuf = 65536, tcp_keepidle = 30, tcp_notsent_lowat = 16384})
+is(ok, true)
+cmp_ok(tcpsock:getopt(socket.OPT_SO_SNDBUF), '>=', 65536)
+is(tcpsock:getopt(socket.OPT_TCP_KEEPIDLE), 30)
+ok, err = tcpsock:setopts({tcp_keepcnt = -1})
+is(ok, nil)
+like(err, "^tcp_keepcnt: ")
+
+-- 6. Listeners sharing a port with reuseport, in forked workers
+local l1, l2, l3 = socket.tcp(), socket.tcp(), socket.tcp()
+is(l1:bind("127.0.0.1", 16788, {reuseport = true}), true)
+is(l2:bind("127.0.0.1", 16788, {reuseport = true}), true)
+is(l3:bind("127.0.0.1", 16788), nil)
+l1:close()
+l2:close()
+l3:close()
+is(socket.fork_workers(2, function (i, cpu) assert(cpu >= 0) end), true)
+like(select(2, socket.fork_workers(1, function () os.exit(3) end)), "worker 1 failed")
+
+-- 7. Connection pool
+local listener = socket.tcp()
+listener:bind("127.0.0.1", 16789)
+listener:listen(2)
+listener:settimeout(1)
+local pool = socket.stats()
+local sock = socket.tcp()
+is(sock:connect("127.0.0.1", 16789), true)
+local conn = listener:accept()
+local reader = conn:readuntil("\n")
+sock:write("a\n")
+conn:write(reader() .. "\n")
+is(sock:readuntil("\n")(), "a")
+is(sock:setkeepalive(10), true)
+local sock = socket.tcp()
+is(sock:connect("127.0.0.1", 16789), true)
+sock:write("b\n")
+conn:write(reader() .. "\n")
+is(sock:readuntil("\n")(), "b", "pooled connection reused")
+conn:close()
+sock:setkeepalive(10)
+local sock = socket.tcp()
+is(sock:connect("127.0.0.1", 16789), true)
+local conn, err = listener:accept()
+isnt(conn, nil, "closed connection not reused")
+is(socket.stats().pool_hits - pool.pool_hits, 1)
+is(socket.stats().pool_misses - pool.pool_misses, 2)
+conn:close()
+sock:close()
+listener:close()
+
+-- 8. Accept a burst of connections at once
+local listener = socket.tcp()
+listener:bind("127.0.0.1", 16790)
+listener:listen(16)
+local clients = {}
+for i = 1, 5 do
+  clients[i] = socket.tcp()
+  clients[i]:connect("127.0.0.1", 16790)
+end
+local conns = listener:acceptmany(3)
+is(#conns, 3)
+local more = listener:acceptmany()
+is(#more, 2)
+for i = 1, 5 do
+  clients[i]:close()
+  ;(conns[i] or more[i - 3]):close()
+end
+listener:close()
+
+-- 9. Fixed receive size
+local listener = socket.tcp()
+listener:bind("127.0.0.1", 16811)
+listener:listen(1)
+local sock = socket.tcp()
+sock:connect("127.0.0.1", 16811)
+local conn = listener:accept()
+is(sock:setreadbuffer(65536), true)
+conn:write(string.rep("x", 40000) .. "\n")
+local before = socket.stats()
+is(#sock:readuntil("\n")(), 40000)
+is(socket.stats().io_fast - before.io_fast, 1, "received at once")
+conn:close()
+sock:close()
+listener:close()
+
+-- 10. Bulk transfer with adaptive receive size
+local body = string.rep("x", 4 * 1024 * 1024)
+local line
+local before = socket.stats()
+is(connected(16812, function (conn) conn:write({body, "\n"}) end,
+             function (sock) line = sock:readuntil("\n")() end), true)
+is(#line, #body)
+cmp_ok(socket.stats().io_fast - before.io_fast, '<', #body / 8192,
+       "fewer receives than with a fixed 8KB size")
+
+-- 11. Large read after buffered data goes straight into the result
+local payload = string.rep("0123456789abcdef", 16384)
+local header, data, used
+is(connected(16813, function (conn)
+  conn:write({"header\n", payload:sub(1, 65536)})
+  -- let the reader park in the middle of the payload
+  socket.sleep(0.01)
+  used = socket.bufstats().used_bytes
+  conn:write(payload:sub(65537))
+end, function (sock)
+  header = sock:readuntil("\n")()
+  data = sock:read(#payload)
+end), true)
+is(header .. #data, "header" .. #payload)
+is(data == payload, true)
+cmp_ok(used, '<', #payload, "read buffer did not grow to the read size")
+
+-- 12. Ports out of range are rejected, not taken for a unix path
+local sock = socket.tcp()
+error_like(function () sock:connect("127.0.0.1", -1) end, "port out of range")
+error_like(function () sock:connect("127.0.0.1", 65536) end, "port out of range")
+error_like(function () socket.address("127.0.0.1", 70000) end, "port out of range")
+sock:close()
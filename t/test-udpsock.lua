@@ -7,7 +7,7 @@ package.cpath = string.format(";%s/?.so;%s/../?.so;", filedir, filedir) .. packa
 require 'Test.More'
 local socket = require "ssocket"
 
-plan(12)
+plan(28)
 
 function string_repeat(str, num)
   local s = ""
@@ -50,3 +50,42 @@ longstr = string_repeat("a",165507)
 ok, err = sendsock:sendto(longstr, "8.8.8.8", 53)
 is(ok, nil)
 is(err, "Message too long")
+
+-- 5. recvmany
+for i = 1, 3 do
+  sendsock:sendto(packet_data .. i, 'localhost', 8888)
+end
+local datas, addrs = recvsock:recvmany(8, 8192, true)
+is(#datas, 3)
+is(datas[3], packet_data .. 3)
+is(addrs[1]:unpack(), '127.0.0.1')
+error_like(function () recvsock:recvmany(4, 2^62) end, "out of range")
+
+-- 6. sendmany
+local count, err = sendsock:sendmany({
+  {packet_data .. 1, 'localhost', 8888},
+  {packet_data .. 2, '127.0.0.1', 8888},
+})
+is(count, 2)
+local datas = recvsock:recvmany(8, 8192)
+is(datas[2], packet_data .. 2)
+local connsock = socket.udp()
+connsock:connect('localhost', 8888)
+is(connsock:sendmany({"a", "b", "c"}), 3)
+is(table.concat(recvsock:recvmany(8, 8192)), "abc")
+
+-- 7. Address objects
+local addr = socket.address('127.0.0.1', 8888)
+like(tostring(addr), "<address: 127.0.0.1:8888>")
+is(sendsock:sendto(packet_data, addr), true)
+local data, peer = recvsock:recvfrom(8192, true)
+is(data, packet_data)
+sendsock:sendto("x", addr)
+local data, peer2 = recvsock:recvfrom(8192, true)
+is(peer2, peer, "addresses are interned")
+is(recvsock:sendto("reply", peer), true)
+is(sendsock:recv(8192), "reply")
+
+-- 8. Socket options
+is(sendsock:setopts({so_broadcast = true, so_rcvbuf = 32768}), true)
+is(sendsock:getopt(socket.OPT_SO_BROADCAST), true)
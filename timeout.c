@@ -1,18 +1,43 @@
+#include "compat.h"
 #include "timeout.h"
-#include <time.h>
+#include <limits.h>
+#include <float.h>
 #include <sys/time.h>
 
 /**
- * Returns current time in ms. (since 1970)
+ * Returns current time in seconds, from a monotonic clock: it does not jump
+ * when the wall-clock time is adjusted. Only differences between two values
+ * are meaningful.
  */
 double
 timeout_gettime(void)
 {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1.0e9;
+#endif
     struct timeval v;
     gettimeofday(&v, NULL);
     return v.tv_sec + v.tv_usec / 1.0e6;
 }
 
+/**
+ * Same clock as timeout_gettime(), cheaper but only accurate to a few ms
+ * where the platform has a coarse clock. Good enough for expiring cache
+ * entries.
+ */
+double
+timeout_gettime_coarse(void)
+{
+#if defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1.0e9;
+#endif
+    return timeout_gettime();
+}
+
 /**
  * Init timeout structure.
  */
@@ -30,7 +55,7 @@ timeout_init(struct timeout *tm, double timeout)
 /**
  * Determine how much time we have left.
  *
- * Returns the number of ms left or -1 if there is no time limit.
+ * Returns the number of seconds left or -1 if there is no time limit.
  */
 double
 timeout_left(struct timeout *tm)
@@ -43,3 +68,48 @@ timeout_left(struct timeout *tm)
         return left;
     }
 }
+
+/**
+ * Make tm expire at deadline (a timeout_gettime() value) at the latest.
+ */
+void
+timeout_clamp(struct timeout *tm, double deadline)
+{
+    if (tm->tm_timeout > 0 && tm->tm_deadline <= deadline)
+        return;
+    tm->tm_deadline = deadline;
+    tm->tm_timeout = deadline - timeout_gettime();
+    if (tm->tm_timeout <= 0)
+        tm->tm_timeout = DBL_MIN;   // expired already, but still limited
+}
+
+/**
+ * Convert time left (as returned by timeout_left) into a poll(2) timeout in
+ * ms. Rounded up, so that waiting less than 1 ms does not turn into a busy
+ * loop of poll(..., 0).
+ */
+int
+timeout_ms(double left)
+{
+    if (left < 0)
+        return -1;
+    double ms = left * 1e3;
+    if (ms >= INT_MAX)
+        return INT_MAX;
+    int timeout = (int)ms;
+    return timeout < ms ? timeout + 1 : timeout;
+}
+
+/**
+ * Convert time left (>= 0) into a timespec, for ppoll(2) and friends.
+ */
+void
+timeout_timespec(double left, struct timespec *ts)
+{
+    ts->tv_sec = (time_t)left;
+    ts->tv_nsec = (long)((left - (double)ts->tv_sec) * 1e9);
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
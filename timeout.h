@@ -1,17 +1,23 @@
 #ifndef TIMEOUT_H
 #define TIMEOUT_H
 
+#include <time.h>
+
 struct timeout {
     /* Invariants:
      * tm_timeout <= 0, means no timeout, then tm_deadline is set as -1
      * tm_timeout > 0, then tm_deadline = timeout_gettime() + tm_timeout
      */
     double tm_timeout;          /* timeout time (in seconds) */
-    double tm_deadline;         /* time of deadline (seconds since 1970) */
+    double tm_deadline;         /* time of deadline (monotonic clock) */
 };
 
 void timeout_init(struct timeout *tm, double timeout);
 double timeout_gettime(void);
+double timeout_gettime_coarse(void);
 double timeout_left(struct timeout *tm);
+void timeout_clamp(struct timeout *tm, double deadline);
+int timeout_ms(double left);
+void timeout_timespec(double left, struct timespec *ts);
 
 #endif
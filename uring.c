@@ -0,0 +1,168 @@
+#include "compat.h"
+#include "uring.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define __load_acquire(p)       __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define __store_release(p, v)   __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/**
+ * Create a ring with room for at least entries submissions.
+ *
+ * Returns 0 on success, -1 on error with errno set (ENOSYS if the kernel
+ * lacks io_uring, EPERM if it is disabled).
+ */
+int
+uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->sq_ptr = r->cq_ptr = r->sqes = MAP_FAILED;
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto err;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto err;
+
+    r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+    return 0;
+
+err:
+    err = errno;
+    uring_exit(r);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Get a zeroed submission entry, which is submitted by next uring_enter().
+ * If the ring is full, pending entries are submitted first.
+ *
+ * Returns NULL on error, with errno set.
+ */
+struct io_uring_sqe *
+uring_sqe(struct uring *r)
+{
+    if (r->sqe_tail - __load_acquire(r->sq_head) >= r->sq_entries) {
+        if (uring_enter(r, 0) == -1)
+            return NULL;
+        if (r->sqe_tail - __load_acquire(r->sq_head) >= r->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    unsigned idx = r->sqe_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    r->to_submit++;
+    __store_release(r->sq_tail, r->sqe_tail);
+    return sqe;
+}
+
+/**
+ * Submit pending entries and wait for at least wait_nr completions, in a
+ * single system call.
+ *
+ * Returns 0 on success, -1 on error with errno set.
+ */
+int
+uring_enter(struct uring *r, unsigned wait_nr)
+{
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    if (r->to_submit == 0 && wait_nr == 0)
+        return 0;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, r->to_submit, wait_nr,
+                      flags, NULL, 0);
+        if (ret >= 0) {
+            r->to_submit -= (unsigned)ret < r->to_submit ? (unsigned)ret : r->to_submit;
+            break;
+        }
+    } while (errno == EINTR);
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Get the next completion, or NULL if none. Call uring_seen() once done
+ * with it.
+ */
+struct io_uring_cqe *
+uring_peek(struct uring *r)
+{
+    unsigned head = *r->cq_head;
+    if (head == __load_acquire(r->cq_tail))
+        return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+/**
+ * Release the completion returned by uring_peek().
+ */
+void
+uring_seen(struct uring *r)
+{
+    __store_release(r->cq_head, *r->cq_head + 1);
+}
+
+/**
+ * Destroy the ring.
+ */
+void
+uring_exit(struct uring *r)
+{
+    if (r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+}
@@ -0,0 +1,39 @@
+#ifndef URING_H
+#define URING_H
+/**
+ * Minimal io_uring(7) submission and completion rings, on top of the raw
+ * system calls, so it does not depend on liburing.
+ */
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;              /* next free sqe, not yet published */
+    unsigned to_submit;             /* published sqes, not yet submitted */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+int uring_enter(struct uring *r, unsigned wait_nr);
+struct io_uring_cqe *uring_peek(struct uring *r);
+void uring_seen(struct uring *r);
+void uring_exit(struct uring *r);
+
+#endif
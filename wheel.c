@@ -0,0 +1,308 @@
+#include "wheel.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_MAXTICK   ((uint64_t)1 << 60)
+
+/*
+ * Level l has 64 slots of 64^l ticks each. A timer is put at the lowest level
+ * whose span covers its distance from the current tick; slots of higher
+ * levels are cascaded into lower ones when the current tick crosses their
+ * boundary. Bitmaps of non-empty slots let idle spans be skipped at once.
+ */
+struct wheel {
+    double origin;                  /* time of tick 0 */
+    uint64_t now;                   /* current tick, earlier ones are done */
+    uint64_t occupied[WHEEL_LEVELS];
+    struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct wheel_timer *expired;    /* expired timers, not popped yet */
+    int count;
+};
+
+/**
+ * Create a wheel, counting ticks from now.
+ */
+struct wheel *
+wheel_create(double now)
+{
+    struct wheel *w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+    w->origin = now;
+    return w;
+}
+
+static uint64_t
+__wheel_tick(struct wheel *w, double t)
+{
+    double tick = (t - w->origin) / WHEEL_TICK;
+    if (!(tick > 0))
+        return 0;
+    if (tick >= (double)WHEEL_MAXTICK)
+        return WHEEL_MAXTICK;
+    return (uint64_t)tick;
+}
+
+static double
+__wheel_time(struct wheel *w, uint64_t tick)
+{
+    return w->origin + (double)tick * WHEEL_TICK;
+}
+
+/**
+ * Distance from slot to the next non-empty slot in bits, 64 if none.
+ * With self set, slot itself counts (distance 0).
+ */
+static int
+__wheel_distance(uint64_t bits, int slot, int self)
+{
+    uint64_t r = slot ? (bits >> slot) | (bits << (WHEEL_SLOTS - slot)) : bits;
+    int d = 0;
+    if (!self)
+        r &= ~(uint64_t)1;
+    if (!r)
+        return WHEEL_SLOTS;
+#if defined(__GNUC__)
+    d = __builtin_ctzll(r);
+#else
+    while (!(r & 1)) {
+        r >>= 1;
+        d++;
+    }
+#endif
+    return d;
+}
+
+static void
+__wheel_link(struct wheel_timer **head, struct wheel_timer *t)
+{
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void
+__wheel_unlink(struct wheel *w, struct wheel_timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    if (t->level >= 0 && !w->slots[t->level][t->slot])
+        w->occupied[t->level] &= ~((uint64_t)1 << t->slot);
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void
+__wheel_insert(struct wheel *w, struct wheel_timer *t)
+{
+    uint64_t tick = __wheel_tick(w, t->deadline);
+    uint64_t delta;
+    int level;
+
+    if (tick < w->now)
+        tick = w->now;
+    delta = tick - w->now;
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+            break;
+    }
+    if (delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) {
+        // beyond the wheel, parked in the farthest slot until cascaded
+        tick = w->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    t->level = level;
+    t->slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    __wheel_link(&w->slots[level][t->slot], t);
+    w->occupied[level] |= (uint64_t)1 << t->slot;
+}
+
+/**
+ * Move timers of higher levels whose slot starts at the current tick down.
+ */
+static void
+__wheel_cascade(struct wheel *w)
+{
+    int level;
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        if (w->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1))
+            break;
+        int slot = (w->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        struct wheel_timer *t = w->slots[level][slot], *next;
+        w->slots[level][slot] = NULL;
+        w->occupied[level] &= ~((uint64_t)1 << slot);
+        for (; t; t = next) {
+            next = t->next;
+            __wheel_insert(w, t);
+        }
+    }
+}
+
+/**
+ * Advance the wheel up to now, moving timers due to the expired list.
+ */
+static void
+__wheel_expire(struct wheel *w, double now)
+{
+    uint64_t target = __wheel_tick(w, now);
+
+    for (;;) {
+        int slot = w->now & WHEEL_MASK;
+        struct wheel_timer *t = w->slots[0][slot], *next;
+        for (; t; t = next) {
+            next = t->next;
+            // the current tick is only partly elapsed
+            if (w->now < target || t->deadline <= now) {
+                __wheel_unlink(w, t);
+                t->level = -1;
+                __wheel_link(&w->expired, t);
+            }
+        }
+        if (w->now >= target)
+            break;
+
+        // jump to the next tick where a slot expires or cascades
+        uint64_t next_tick;
+        int level = 0;
+        while (level < WHEEL_LEVELS && !w->occupied[level])
+            level++;
+        if (level == WHEEL_LEVELS) {
+            w->now = target;
+            break;
+        }
+        uint64_t span = (uint64_t)1 << (WHEEL_BITS * (level ? level : 1));
+        next_tick = (w->now | (span - 1)) + 1;
+        if (level == 0) {
+            uint64_t n = w->now + __wheel_distance(w->occupied[0], slot, 0);
+            if (n < next_tick)
+                next_tick = n;
+        }
+        if (next_tick > target)
+            next_tick = target;
+        w->now = next_tick;
+        if (!(w->now & WHEEL_MASK))
+            __wheel_cascade(w);
+    }
+}
+
+/**
+ * Schedule timer t at deadline, rescheduling it if already pending.
+ */
+void
+wheel_add(struct wheel *w, struct wheel_timer *t, double deadline)
+{
+    if (t->pprev)
+        wheel_del(w, t);
+    t->deadline = deadline;
+    __wheel_insert(w, t);
+    w->count++;
+}
+
+/**
+ * Cancel timer t, if pending.
+ */
+void
+wheel_del(struct wheel *w, struct wheel_timer *t)
+{
+    if (!t->pprev)
+        return;
+    __wheel_unlink(w, t);
+    w->count--;
+}
+
+/**
+ * Time left until the wheel needs attention from now (in seconds): the
+ * earliest deadline, or a slot to cascade. Returns -1 if no timer is pending.
+ */
+double
+wheel_next(struct wheel *w, double now)
+{
+    double next = -1;
+    int level;
+
+    if (w->expired)
+        return 0;
+    if (!w->occupied[0]) {
+        for (level = 1; level < WHEEL_LEVELS && !w->occupied[level]; level++)
+            ;
+        if (level == WHEEL_LEVELS)
+            return -1;
+    } else {
+        // exact deadline of the nearest slot
+        int slot = w->now & WHEEL_MASK;
+        slot = (slot + __wheel_distance(w->occupied[0], slot, 1)) & WHEEL_MASK;
+        struct wheel_timer *t;
+        for (t = w->slots[0][slot]; t; t = t->next) {
+            if (next < 0 || t->deadline < next)
+                next = t->deadline;
+        }
+    }
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        if (!w->occupied[level])
+            continue;
+        int shift = WHEEL_BITS * level;
+        int slot = (w->now >> shift) & WHEEL_MASK;
+        uint64_t tick = ((w->now >> shift) +
+                         __wheel_distance(w->occupied[level], slot, 0)) << shift;
+        double at = __wheel_time(w, tick);
+        if (next < 0 || at < next)
+            next = at;
+    }
+
+    next -= now;
+    return next > 0 ? next : 0;
+}
+
+/**
+ * Pop a timer whose deadline is at or before now, NULL if none.
+ */
+struct wheel_timer *
+wheel_expired(struct wheel *w, double now)
+{
+    struct wheel_timer *t;
+    if (!w->expired)
+        __wheel_expire(w, now);
+    t = w->expired;
+    if (t)
+        wheel_del(w, t);
+    return t;
+}
+
+/**
+ * Number of pending timers.
+ */
+int
+wheel_count(struct wheel *w)
+{
+    return w->count;
+}
+
+/**
+ * Any pending timer, NULL if none. To drain the wheel before deleting it.
+ */
+struct wheel_timer *
+wheel_any(struct wheel *w)
+{
+    int level;
+    if (w->expired)
+        return w->expired;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (w->occupied[level])
+            return w->slots[level][__wheel_distance(w->occupied[level], 0, 1)];
+    }
+    return NULL;
+}
+
+/**
+ * Delete the wheel. Pending timers are owned by the caller.
+ */
+void
+wheel_delete(struct wheel *w)
+{
+    free(w);
+}
@@ -0,0 +1,40 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+/**
+ * Hierarchical timer wheel.
+ *
+ * Adding and removing a timer costs O(1) whatever the number of timers, which
+ * suits many per-connection deadlines that are mostly cancelled before they
+ * expire. Timers are bucketed by ticks of WHEEL_TICK seconds, but keep their
+ * exact deadline: wheel_next() and wheel_expired() honour it, so deadlines
+ * shorter than a tick work as expected.
+ */
+
+#define WHEEL_TICK      1e-3    /* seconds */
+#define WHEEL_BITS      6
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_LEVELS    5       /* 64^5 ticks, about 12 days */
+
+struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev; /* NULL if not pending */
+    double deadline;            /* same clock as timeout_gettime() */
+    void *ud;
+    int level;                  /* -1 once expired */
+    int slot;
+};
+
+struct wheel;
+
+struct wheel *wheel_create(double now);
+void wheel_add(struct wheel *w, struct wheel_timer *t, double deadline);
+void wheel_del(struct wheel *w, struct wheel_timer *t);
+double wheel_next(struct wheel *w, double now);
+struct wheel_timer *wheel_expired(struct wheel *w, double now);
+int wheel_count(struct wheel *w);
+struct wheel_timer *wheel_any(struct wheel *w);
+void wheel_delete(struct wheel *w);
+
+#define wheel_pending(t)    ((t)->pprev != NULL)
+
+#endif